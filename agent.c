@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <sys/statvfs.h>
 #include <sys/utsname.h>
@@ -59,6 +60,7 @@ details_t details;
 stats_t stats[CONFIG_MAX_CACHED];
 uint32 stats_count = 0, stats_pos = (uint32)-1;
 uint16 http_req_len;
+int https_fd = -1;
 stats_t *current_stats;
 net_header_t header;
 jiffies_spent_t cpu_start, cpu_end;
@@ -389,30 +391,43 @@ int setup_bearssl_connection(int *fd) {
     return 0;
 }
 
-int send_https_request(void) {
-    int fd, err = setup_bearssl_connection(&fd), ret = -6;
+void close_https_connection(void) {
+    br_sslio_close(&sslio_context);
+    close(https_fd);
+    https_fd = -1;
+}
+
+int send_https_request(void) { // the connection is kept open for the next upload if the server allows it
+    int err, ret = -6;
     int16 len;
-    if (err)
+    bool reused = https_fd != -1;
+    if (!reused && (err = setup_bearssl_connection(&https_fd))) {
+        https_fd = -1;
         return err;
-    if (br_sslio_write_all(&sslio_context, http_buf, http_req_len)) {
-        br_sslio_close(&sslio_context);
-        close(fd);
-        return -4;
     }
-    if (br_sslio_flush(&sslio_context)) {
-        br_sslio_close(&sslio_context);
-        close(fd);
-        return -5;
-    }
-    if ((len = br_sslio_read(&sslio_context, &response_buf, sizeof(response_buf))) >= (int16)strlen("HTTP/1.1 200\r\n\r\n"))
+    if (br_sslio_write_all(&sslio_context, http_buf, http_req_len))
+        ret = -4;
+    else if (br_sslio_flush(&sslio_context))
+        ret = -5;
+    else if ((len = br_sslio_read(&sslio_context, &response_buf, sizeof(response_buf))) >= (int16)strlen("HTTP/1.1 200\r\n\r\n")) {
         for (uint16 i = strlen("HTTP/1.1 200\r\n\r\n"); i < len; ++i)
             if (response_buf[i] == '\n' && response_buf[i - 2] == '\n' && response_buf[i - 1] == '\r' && response_buf[i - 3] == '\r') {
-                if (len >= i + 1 && response_buf[i + 1] == '1')
+                if (len >= i + 1 && response_buf[i + 1] == '1') {
                     ret = 0;
+                    if (len != i + 2) // unknown what the rest is, so don't reuse the connection
+                        goto close;
+                    for (uint16 y = 0; y < i; ++y)
+                        if (response_buf[y] == '\n' && !strncasecmp(response_buf + y + 1, SLEN("connection: close")))
+                            goto close;
+                    return ret;
+                }
                 break;
             }
-    br_sslio_close(&sslio_context);
-    close(fd);
+    }
+close:
+    close_https_connection();
+    if (ret && reused) // the server likely closed the idle connection, so try again with a new one
+        return send_https_request();
     return ret;
 }
 
@@ -489,7 +504,7 @@ upload_data:
     str_append(http_buf, &http_req_len, host);
     str_append(http_buf, &http_req_len, "\r\nContent-Length: ");
     str_append_uint(http_buf, &http_req_len, content_length);
-    str_append(http_buf, &http_req_len, "\r\nConnection: close\r\n\r\n");
+    str_append(http_buf, &http_req_len, "\r\n\r\n");
     str_append_len(http_buf, &http_req_len, (char *)&header, sizeof(header));
     if (header.includes_details)
         str_append_len(http_buf, &http_req_len, (char *)&details, sizeof(details));
@@ -12,4 +12,34 @@
 
 #define SERVER_LISTEN_BACKLOG SOMAXCONN
 
+#define SERVER_MAX_MONITORS 262144 // size of the shared memory for the monitor states (only touched pages use memory), monitors that are deleted still count until the server is restarted
+
+#define SERVER_MAX_CONNECTIONS 1024 // connections that are still receiving their request, if there are more, new ones are closed immediately
+
+#define SERVER_CONNECTION_TIMEOUT_MS 1000 // close connections that didn't send a complete request in this time
+
+#define SERVER_KEEP_ALIVE_TIMEOUT_MS 75000 // close idle keep-alive connections after this time, should be longer than CONFIG_MEASURE_EVERY_N_SECONDS so that agents can reuse their connection
+
+#define SERVER_HOT_TAIL_HOURS 25 // the newest data of every monitor is also kept in shared memory (with the default CONFIG_MEASURE_EVERY_N_SECONDS 59 KiB per monitor), so that the charts up to 24 hours and the notifications don't have to read the files; 0 disables it
+
+#define SERVER_MAX_OPEN_MONITORS 512 // the files of at most this many monitors (up to 7 fds each) are kept open per worker, the others are opened when they are needed
+
+#define SERVER_PREFORKED_CHILDREN 8 // per worker, they handle the requests for the web interface (except for the admin API) so that no child has to be started for every request; if all are busy, the requests wait for one. 0 starts a child for every request instead (at most MAX_CHILDREN at once, which are also used if too many requests are waiting)
+
+#define SERVER_MAX_STREAMS 256 // live update streams of the status pages (/api/stream/page/{PAGE}) per worker, they are kept open by the worker itself; further ones are rejected and the page falls back to polling
+
+#define SERVER_GZIP_MIN_SIZE 1024 // API responses of at least this size (in bytes) are gzipped for clients that accept it, 0 disables it (the HTML files are sent precompressed instead if {FILE}.br or {FILE}.gz exists and isn't older)
+
+#define SERVER_GROUP_COMMIT_MS 5 // uploads are buffered and written (and only then acknowledged) together at most this long after the first one was received
+#define SERVER_GROUP_COMMIT_MAX_UPLOADS 256 // write earlier if this many uploads are buffered
+#define SERVER_GROUP_COMMIT_BUF_SIZE 262144 // or if the buffered stats would exceed this size (in bytes)
+#define SERVER_GROUP_COMMIT_FSYNC 0 // 1: fdatasync() the data files before the uploads are acknowledged, so that acknowledged data survives a power loss
+
+#define SERVER_COLUMNAR_SEGMENTS 0 // 1: store the data in columnar segments of 128 stats ({TOKEN}.seg, in the data file they are replaced with a hole), existing data is converted when the server starts; switching back to 0 converts it back
+#define SERVER_COMPRESSED_SEGMENTS 0 // 1 (only with SERVER_COLUMNAR_SEGMENTS): compress the segments (delta-of-delta times, XORed percentages, zig-zag encoded counter deltas; {TOKEN}.sgo contains their offsets), existing segments are converted when the server starts
+
+#define SERVER_LOG_STRUCTURED 0 // 1: uploads are appended to one shared log ({PATH}/log, one sequential write and at most one fdatasync() per group commit, every batch has a CRC32C checksum) and only moved to the data files of the monitors by a periodic compaction, a log that is left over is replayed when the server starts up to the first damaged batch; 0: uploads are appended to the data files directly (without checksums, only an incomplete stats_t or zeros at the end are removed when the server starts)
+#define SERVER_LOG_COMPACT_SECONDS 300 // compact the log at least this often
+#define SERVER_LOG_MAX_PENDING 16 // or earlier if a monitor has this many uploads (or group commits, uploads of the same one count once) in the log
+
 // #define LISTEN_ALL // this is necessary for docker as otherwise it will not be reachable from outside of the container itself
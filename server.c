@@ -19,9 +19,17 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "server.h"
 
 void sigchld_handler(void) {
-    int status;
-    while (waitpid(-1, &status, WNOHANG) > 0)
-        __atomic_sub_fetch(&children, 1, __ATOMIC_RELAXED);
+    int status, pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        uint32 i = 0;
+        while (i < pool_size && pool_pids[i] != pid)
+            ++i;
+        if (i < pool_size) { // restarted by pool_start()
+            pool_pids[i] = 0;
+            __atomic_store_n(&pool_restart, true, __ATOMIC_RELAXED);
+        } else
+            __atomic_sub_fetch(&children, 1, __ATOMIC_RELAXED);
+    }
 }
 
 void sigalrm_handler(void) {
@@ -36,25 +44,48 @@ bool sock_ready(int fd, bool read, int timeout_ms) {
     return false;
 }
 
-monitor_details_t *get_monitor_details_by_public(const char token[32]) {
-    for (uint32 i = 0; i < details_count; ++i)
-        if (!memcmp(details[i].public_token, token, 32))
-            return details + i;
+uint32 token_hash(const char token[32]) { // FNV-1a
+    uint32 hash = 2166136261u;
+    for (uint8 i = 0; i < 32; ++i)
+        hash = (hash ^ (uint8)token[i]) * 16777619u;
+    return hash;
+}
+
+uint32 token_index_slots(uint32 count) { // at most half of the slots are used
+    uint32 slots = 2;
+    while (slots < count * 2)
+        slots <<= 1;
+    return slots;
+}
+
+void token_index_insert(uint32 *index, uint32 mask, const char token[32], uint32 pos) {
+    uint32 slot = token_hash(token) & mask;
+    while (index[slot])
+        slot = (slot + 1) & mask;
+    index[slot] = pos + 1;
+}
+
+// the indexes (uint32 slots, 0 if empty, otherwise the position in the array + 1) are stored directly after the details/notification_details array, see parse_data_json()
+#define PRIVATE_TOKEN_INDEX(array, count) ((uint32 *)((array) + (count)))
+#define PUBLIC_TOKEN_INDEX(array, count, mask) (PRIVATE_TOKEN_INDEX(array, count) + (mask) + 1)
+#define TOKEN_INDEX_LOOKUP(index, array, field) \
+    if (!details_count) \
+        return NULL; \
+    for (uint32 slot = token_hash(token) & token_index_mask; index[slot]; slot = (slot + 1) & token_index_mask) \
+        if (!memcmp(array[index[slot] - 1].field, token, 32)) \
+            return array + index[slot] - 1; \
     return NULL;
+
+monitor_details_t *get_monitor_details_by_public(const char token[32]) {
+    TOKEN_INDEX_LOOKUP(PUBLIC_TOKEN_INDEX(details, details_count, token_index_mask), details, public_token)
 }
 
 monitor_details_t *get_monitor_details_by_private(const char token[32]) {
-    for (uint32 i = 0; i < details_count; ++i)
-        if (!memcmp(details[i].token, token, 32))
-            return details + i;
-    return NULL;
+    TOKEN_INDEX_LOOKUP(PRIVATE_TOKEN_INDEX(details, details_count), details, token)
 }
 
 notification_monitor_details_t *get_notification_monitor_details_by_private(const char token[32]) {
-    for (uint32 i = 0; i < details_count; ++i)
-        if (!memcmp(notification_details[i].token, token, 32))
-            return notification_details + i;
-    return NULL;
+    TOKEN_INDEX_LOOKUP(PRIVATE_TOKEN_INDEX(notification_details, details_count), notification_details, token)
 }
 
 int open_with_retries(const char *filename, int flags) {
@@ -103,23 +134,981 @@ json_object *load_json_file(char *name) {
     return ret;
 }
 
-void load_totals(monitor_details_t *monitor) { // http_buf is used even though this is no HTTP, but this isn't problematic
-    monitor->rx_total = monitor->tx_total = monitor->sectors_read_total = monitor->sectors_written_total = 0;
-    uint32 file_len = fd_size(monitor->fd), pos = 0;
+void monitor_file_name(char *buf, const char *token, const char *suffix) { // suffix has to be 4 characters long at most
+    memcpy(buf, token, 32);
+    memcpy(buf + 32, suffix, strlen(suffix) + 1); // also copy nullbyte
+}
+
+void segment_from_stats(segment_t *segment, stats_t *stats) { // stats has to contain SEGMENT_RECORDS elements
+    for (uint16 i = 0; i < SEGMENT_RECORDS; ++i) {
+        uint8 *percent = &stats[i].cpu_usage_before_decimal; // the percentages are consecutive
+        segment->time[i] = stats[i].time;
+        for (uint8 y = 0; y < 6; ++y)
+            segment->percent[y][i] = (uint16)percent[y * 2] * 100 + percent[y * 2 + 1];
+        segment->counter[0][i] = stats[i].rx_bytes;
+        segment->counter[1][i] = stats[i].tx_bytes;
+        segment->counter[2][i] = stats[i].read_sectors;
+        segment->counter[3][i] = stats[i].written_sectors;
+    }
+}
+
+void segment_to_stats(segment_t *segment, stats_t *stats, uint16 from, uint16 count) {
+    for (uint16 i = 0; i < count; ++i) {
+        uint8 *percent = &stats[i].cpu_usage_before_decimal;
+        uint16 pos = from + i; // GCC 12 with -O3 (-fpeel-loops) miscompiles the loop if from + i is used in the indices
+        stats[i].time = segment->time[pos];
+        for (uint8 y = 0; y < 6; ++y) {
+            percent[y * 2] = segment->percent[y][pos] / 100;
+            percent[y * 2 + 1] = segment->percent[y][pos] % 100;
+        }
+        stats[i].rx_bytes = segment->counter[0][pos];
+        stats[i].tx_bytes = segment->counter[1][pos];
+        stats[i].read_sectors = segment->counter[2][pos];
+        stats[i].written_sectors = segment->counter[3][pos];
+    }
+}
+
+uint32 crc32c(uint32 crc, const void *data, uint32 len) { // CRC32C (Castagnoli), crc is 0 or the result for the data before
+    const uint8 *ptr = data;
+    crc = ~crc;
+#ifdef __SSE4_2__ // the crc32 instruction, e.g. with -msse4.2 or -march=native
+    for (; len >= 8; ptr += 8, len -= 8) {
+        uint64 value;
+        memcpy(&value, ptr, 8);
+        crc = __builtin_ia32_crc32di(crc, value);
+    }
+    for (; len; --len)
+        crc = __builtin_ia32_crc32qi(crc, *ptr++);
+#else
+    static uint32 table[256];
+    if (!table[1])
+        for (uint32 i = 0; i < 256; ++i) {
+            uint32 value = i;
+            for (uint8 bit = 0; bit < 8; ++bit)
+                value = value & 1 ? (value >> 1) ^ 0x82f63b78 : value >> 1;
+            table[i] = value;
+        }
+    for (; len; --len)
+        crc = table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+#endif
+    return ~crc;
+}
+
+uint8 *varint_put(uint8 *ptr, uint64 value) { // returns the pointer after the varint
+    for (; value >= 0x80; value >>= 7)
+        *ptr++ = (uint8)value | 0x80;
+    *ptr++ = value;
+    return ptr;
+}
+
+const uint8 *varint_get(const uint8 *ptr, const uint8 *end, uint64 *value) { // returns NULL if the varint is incomplete
+    *value = 0;
+    for (uint8 shift = 0; ptr < end && shift < 64; shift += 7) {
+        *value |= (uint64)(*ptr & 0x7f) << shift;
+        if (!(*ptr++ & 0x80))
+            return ptr;
+    }
+    return NULL;
+}
+
+uint32 crc32(uint32 crc, const void *data, uint32 len) { // CRC-32 (as used by gzip), crc is 0 or the result for the data before
+    static uint32 table[256];
+    const uint8 *ptr = data;
+    if (!table[1])
+        for (uint32 i = 0; i < 256; ++i) {
+            uint32 value = i;
+            for (uint8 bit = 0; bit < 8; ++bit)
+                value = value & 1 ? (value >> 1) ^ 0xedb88320 : value >> 1;
+            table[i] = value;
+        }
+    crc = ~crc;
+    for (; len; --len)
+        crc = table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// a fast gzip compressor: one deflate block with the fixed Huffman codes, matches are found greedily with a single hash table entry per 4 bytes (without chains), which is enough for the repetitive JSON of the API
+#define GZIP_BOUND(len) ((len) + (len) / 8 + 32) // 9 bits per literal at most, plus header and trailer
+#define GZIP_HASH_BITS 14
+typedef struct {
+    uint8 *out;
+    uint64 bits;
+    uint8 bits_count;
+} bit_writer_t;
+
+void bits_put(bit_writer_t *writer, uint32 value, uint8 count) {
+    writer->bits |= (uint64)value << writer->bits_count;
+    writer->bits_count += count;
+    while (writer->bits_count >= 8) {
+        *writer->out++ = writer->bits;
+        writer->bits >>= 8;
+        writer->bits_count -= 8;
+    }
+}
+
+uint32 bits_reverse(uint32 value, uint8 count) {
+    uint32 result = 0;
+    for (uint8 i = 0; i < count; ++i, value >>= 1)
+        result = (result << 1) | (value & 1);
+    return result;
+}
+
+void gzip_symbol(bit_writer_t *writer, uint16 symbol) { // a literal/length symbol with its fixed Huffman code
+    static uint16 codes[288];
+    static uint8 lengths[288];
+    if (!lengths[0])
+        for (uint16 i = 0; i < 288; ++i) {
+            if (i < 144)
+                lengths[i] = 8, codes[i] = bits_reverse(0x30 + i, 8);
+            else if (i < 256)
+                lengths[i] = 9, codes[i] = bits_reverse(0x190 + i - 144, 9);
+            else if (i < 280)
+                lengths[i] = 7, codes[i] = bits_reverse(i - 256, 7);
+            else
+                lengths[i] = 8, codes[i] = bits_reverse(0xc0 + i - 280, 8);
+        }
+    bits_put(writer, codes[symbol], lengths[symbol]);
+}
+
+void gzip_match(bit_writer_t *writer, uint32 length, uint32 distance) { // length 3-258, distance 1-32768
+    uint32 value = length - 3, extra_bits;
+    if (value < 8)
+        gzip_symbol(writer, 257 + value);
+    else if (value == 255)
+        gzip_symbol(writer, 285);
+    else {
+        extra_bits = 31 - __builtin_clz(value) - 2;
+        gzip_symbol(writer, 257 + 4 * extra_bits + 4 + ((value >> extra_bits) & 3));
+        bits_put(writer, value & ((1U << extra_bits) - 1), extra_bits);
+    }
+    value = distance - 1;
+    if (value < 4)
+        bits_put(writer, bits_reverse(value, 5), 5);
+    else {
+        extra_bits = 31 - __builtin_clz(value) - 1;
+        bits_put(writer, bits_reverse(2 * extra_bits + 2 + ((value >> extra_bits) & 1), 5), 5);
+        bits_put(writer, value & ((1U << extra_bits) - 1), extra_bits);
+    }
+}
+
+uint32 gzip(const uint8 *in, uint32 len, uint8 *out) { // out has to be GZIP_BOUND(len) bytes long, returns the length
+    static uint32 head[1 << GZIP_HASH_BITS];
+    static const uint8 header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    bit_writer_t writer = { out + sizeof(header), 0, 0 };
+    uint32 pos = 0, crc = crc32(0, in, len), value, candidate;
+    memcpy(out, header, sizeof(header));
+    memset(head, 0, sizeof(head));
+    bits_put(&writer, 3, 3); // final block with the fixed codes
+    while (pos + 4 <= len) {
+        memcpy(&value, in + pos, 4);
+        uint32 *entry = &head[(value * 2654435761U) >> (32 - GZIP_HASH_BITS)];
+        candidate = *entry, *entry = pos;
+        if (candidate < pos && pos - candidate <= 32768 && !memcmp(in + candidate, in + pos, 4)) {
+            uint32 length = 4, max_length = min(len - pos, 258);
+            while (length < max_length && in[candidate + length] == in[pos + length])
+                ++length;
+            gzip_match(&writer, length, pos - candidate);
+            for (uint32 end = pos + length; ++pos < end;) // so that repetitions directly after this one are found
+                if (pos + 4 <= len) {
+                    memcpy(&value, in + pos, 4);
+                    head[(value * 2654435761U) >> (32 - GZIP_HASH_BITS)] = pos;
+                }
+        } else
+            gzip_symbol(&writer, in[pos++]);
+    }
+    while (pos < len)
+        gzip_symbol(&writer, in[pos++]);
+    gzip_symbol(&writer, 256); // end of block
+    bits_put(&writer, 0, 7); // flush the last byte
+    memcpy(writer.out, &crc, sizeof(uint32));
+    memcpy(writer.out + sizeof(uint32), &len, sizeof(uint32));
+    return writer.out + 2 * sizeof(uint32) - out;
+}
+
+// every column is stored as varints: the times as delta of delta (so 0 as long as the agent measures at a regular interval), the percentages XORed with the previous one and the counters as zig-zag encoded difference to the previous one
+uint32 segment_compress(segment_t *segment, uint8 *buf) { // buf has to be SEGMENT_COMPRESSED_MAX_SIZE bytes long, returns the length
+    uint8 *ptr = varint_put(buf, segment->time[0]);
+    int64 last_delta = 0;
+    for (uint16 i = 1; i < SEGMENT_RECORDS; ++i) {
+        int64 delta = (int64)segment->time[i] - segment->time[i - 1];
+        ptr = varint_put(ptr, ZIGZAG(delta - last_delta));
+        last_delta = delta;
+    }
+    for (uint8 y = 0; y < 6; ++y)
+        for (uint16 i = 0; i < SEGMENT_RECORDS; ++i)
+            ptr = varint_put(ptr, segment->percent[y][i] ^ (i ? segment->percent[y][i - 1] : 0));
+    for (uint8 y = 0; y < 4; ++y)
+        for (uint16 i = 0; i < SEGMENT_RECORDS; ++i)
+            ptr = varint_put(ptr, ZIGZAG(segment->counter[y][i] - (i ? segment->counter[y][i - 1] : 0)));
+    return ptr - buf;
+}
+
+uint32 segment_decompress(segment_t *segment, const uint8 *buf, uint32 len) { // returns the length of the compressed segment (buf may contain more data), 0 if it is incomplete
+    const uint8 *ptr = buf, *end = buf + len;
+    uint64 value;
+    int64 delta = 0;
+    if (!(ptr = varint_get(ptr, end, &value)))
+        return 0;
+    segment->time[0] = value;
+    for (uint16 i = 1; i < SEGMENT_RECORDS; ++i) {
+        if (!(ptr = varint_get(ptr, end, &value)))
+            return 0;
+        delta += UNZIGZAG(value);
+        segment->time[i] = segment->time[i - 1] + delta;
+    }
+    for (uint8 y = 0; y < 6; ++y)
+        for (uint16 i = 0; i < SEGMENT_RECORDS; ++i) {
+            if (!(ptr = varint_get(ptr, end, &value)))
+                return 0;
+            segment->percent[y][i] = value ^ (i ? segment->percent[y][i - 1] : 0);
+        }
+    for (uint8 y = 0; y < 4; ++y)
+        for (uint16 i = 0; i < SEGMENT_RECORDS; ++i) {
+            if (!(ptr = varint_get(ptr, end, &value)))
+                return 0;
+            segment->counter[y][i] = (i ? segment->counter[y][i - 1] : 0) + (uint64)UNZIGZAG(value);
+        }
+    return ptr - buf;
+}
+
+// the segment file contains either segment_t or, if segment_offsets_fd isn't -1 (SERVER_COMPRESSED_SEGMENTS), compressed segments whose offsets are in the segment offsets file ({TOKEN}.sgo)
+uint32 segments_count(int segments_fd, int segment_offsets_fd) {
+    if (segments_fd == -1)
+        return 0;
+    return segment_offsets_fd == -1 ? fd_size(segments_fd) / sizeof(segment_t) : fd_size(segment_offsets_fd) / sizeof(uint32);
+}
+
+uint32 segment_read(int segments_fd, int segment_offsets_fd, uint32 index, segment_t *segment) { // returns the length of the segment in the segment file, 0 on error
+    uint8 buf[SEGMENT_COMPRESSED_MAX_SIZE];
+    uint32 offsets[2];
     int32 read_len;
-    if (!file_len) // problematic in case fstat failed, but not much else to do here...
+    if (segment_offsets_fd == -1)
+        return pread(segments_fd, segment, sizeof(segment_t), index * sizeof(segment_t)) == sizeof(segment_t) ? sizeof(segment_t) : 0;
+    if ((read_len = pread(segment_offsets_fd, offsets, sizeof(offsets), index * sizeof(uint32))) < (int32)sizeof(uint32))
+        return 0;
+    if (read_len < (int32)sizeof(offsets)) // the last segment, the segment file may already contain the next one if it is just being written
+        offsets[1] = fd_size(segments_fd);
+    if (offsets[1] <= offsets[0] || (read_len = pread(segments_fd, buf, min(offsets[1] - offsets[0], sizeof(buf)), offsets[0])) <= 0)
+        return 0;
+    return segment_decompress(segment, buf, read_len);
+}
+
+bool segment_append(int segments_fd, int segment_offsets_fd, segment_t *segment) { // the segment is removed again if it couldn't be written completely
+    uint8 buf[SEGMENT_COMPRESSED_MAX_SIZE];
+    uint32 len, offset = fd_size(segments_fd);
+    if (segment_offsets_fd == -1) {
+        if (write(segments_fd, segment, sizeof(segment_t)) == sizeof(segment_t))
+            return true;
+        ftruncate(segments_fd, offset - offset % sizeof(segment_t));
+        return false;
+    }
+    len = segment_compress(segment, buf);
+    if (write(segments_fd, buf, len) == (int32)len) {
+        if (write(segment_offsets_fd, &offset, sizeof(uint32)) == sizeof(uint32))
+            return true;
+        uint32 offsets_len = fd_size(segment_offsets_fd);
+        ftruncate(segment_offsets_fd, offsets_len - offsets_len % sizeof(uint32));
+    }
+    ftruncate(segments_fd, offset);
+    return false;
+}
+
+uint32 segments_last_time(int segments_fd, int segment_offsets_fd) { // 0 if there are no segments
+    segment_t segment;
+    uint32 segments = segments_count(segments_fd, segment_offsets_fd);
+    if (!segments || !segment_read(segments_fd, segment_offsets_fd, segments - 1, &segment))
+        return 0;
+    return segment.time[SEGMENT_RECORDS - 1];
+}
+
+// removes an incomplete stats_t and zeros (which the file system may leave after a power loss, the time is never 0) at the end of a data file, but not the first sealed ones (the hole of the segments, see segments_seal()), returns the new size
+uint32 data_file_recover(int fd, uint32 sealed) {
+    stats_t last;
+    uint32 file_len = fd_size(fd), len = file_len - file_len % sizeof(stats_t);
+    while (len > sealed * sizeof(stats_t) && pread(fd, &last, sizeof(stats_t), len - sizeof(stats_t)) == sizeof(stats_t) && !last.time)
+        len -= sizeof(stats_t);
+    if (len != file_len)
+        ftruncate(fd, len);
+    return len;
+}
+
+void hot_tail_write_begin(monitor_state_t *state) { // the state lock has to be held (or loading has to be set)
+    __atomic_store_n(&state->hot_tail_seq, state->hot_tail_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void hot_tail_write_end(monitor_state_t *state) {
+    __atomic_store_n(&state->hot_tail_seq, state->hot_tail_seq + 1, __ATOMIC_RELEASE);
+}
+
+void hot_tail_add(monitor_state_t *state, const stats_t *element) { // after time_index_add(), between hot_tail_write_begin() and hot_tail_write_end()
+    if (!SERVER_HOT_TAIL_HOURS)
         return;
-    while (pos < file_len && (read_len = pread(monitor->fd, http_buf, min(sizeof(stats_t) * (sizeof(http_buf) / sizeof(stats_t)), file_len - pos), pos)) > 0) {
-        uint16 count = read_len / sizeof(stats_t);
-        pos += count * sizeof(stats_t);
+    hot_tails[(state - monitor_states) * HOT_TAIL_RECORDS + (state->records - 1) % HOT_TAIL_RECORDS] = *element;
+    if (state->hot_tail_count < HOT_TAIL_RECORDS)
+        ++state->hot_tail_count;
+}
+
+bool hot_tail_records(const monitor_state_t *state, uint32 *records) { // false if the state is just being changed
+    if (!SERVER_HOT_TAIL_HOURS || !state)
+        return false;
+    uint32 seq = __atomic_load_n(&state->hot_tail_seq, __ATOMIC_ACQUIRE);
+    *records = __atomic_load_n(&state->records, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return !(seq & 1) && __atomic_load_n(&state->hot_tail_seq, __ATOMIC_RELAXED) == seq;
+}
+
+// copies up to count stats_t starting at pos from the hot tail, returns 0 if pos isn't in it (or if it was changed meanwhile)
+uint32 hot_tail_read(const monitor_state_t *state, uint32 pos, stats_t *buf, uint32 count) {
+    if (!SERVER_HOT_TAIL_HOURS || !state)
+        return 0;
+    uint32 seq = __atomic_load_n(&state->hot_tail_seq, __ATOMIC_ACQUIRE), records = __atomic_load_n(&state->records, __ATOMIC_RELAXED), hot_tail_count = __atomic_load_n(&state->hot_tail_count, __ATOMIC_RELAXED), slot = pos % HOT_TAIL_RECORDS;
+    if ((seq & 1) || pos < records - hot_tail_count || pos >= records)
+        return 0;
+    count = min(count, records - pos);
+    count = min(count, HOT_TAIL_RECORDS - slot);
+    memcpy(buf, hot_tails + (state - monitor_states) * HOT_TAIL_RECORDS + slot, count * sizeof(stats_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&state->hot_tail_seq, __ATOMIC_RELAXED) == seq ? count : 0;
+}
+
+// returns true and the position of the first stats_t with a time >= time in pos if it is in the hot tail (or before the first stats_t)
+bool hot_tail_find(const monitor_state_t *state, int64 time, uint32 *pos) {
+    if (!SERVER_HOT_TAIL_HOURS || !state)
+        return false;
+    const stats_t *hot_tail = hot_tails + (state - monitor_states) * HOT_TAIL_RECORDS;
+    uint32 seq = __atomic_load_n(&state->hot_tail_seq, __ATOMIC_ACQUIRE), records = __atomic_load_n(&state->records, __ATOMIC_RELAXED), hot_tail_count = __atomic_load_n(&state->hot_tail_count, __ATOMIC_RELAXED), low = records - hot_tail_count, high = records;
+    if ((seq & 1) || !hot_tail_count || (low && hot_tail[low % HOT_TAIL_RECORDS].time >= time)) // it may be before the hot tail
+        return false;
+    while (low < high) {
+        uint32 mid = low + (high - low) / 2;
+        if (hot_tail[mid % HOT_TAIL_RECORDS].time < time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&state->hot_tail_seq, __ATOMIC_RELAXED) != seq)
+        return false;
+    *pos = low;
+    return true;
+}
+
+void log_write_begin(monitor_state_t *state) { // the state lock has to be held
+    __atomic_store_n(&state->log_seq, state->log_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void log_write_end(monitor_state_t *state) {
+    __atomic_store_n(&state->log_seq, state->log_seq + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct { // the blocks of a monitor that this process can read, see log_blocks_read()
+    uint32 records; // of both
+    uint32 old_records;
+    uint8 old_count;
+    uint8 count;
+    log_block_t old[SERVER_LOG_MAX_PENDING];
+    log_block_t current[SERVER_LOG_MAX_PENDING];
+} log_blocks_t;
+
+// copies the blocks of state that are in a log this process has opened, together with the size of the data file (which log_compact() changes at the same time) as records
+void log_blocks_read(const monitor_state_t *state, int fd, uint32 *records, log_blocks_t *blocks) {
+    uint32 seq;
+    for (;;) {
+        while ((seq = __atomic_load_n(&state->log_seq, __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+        *records = fd_size(fd) / sizeof(stats_t);
+        blocks->old_count = old_log_fd != -1 && state->old_log_generation == old_log_fd_generation ? min(state->old_log_blocks_count, SERVER_LOG_MAX_PENDING) : 0;
+        blocks->old_records = blocks->old_count ? state->old_log_records : 0;
+        blocks->count = state->log_generation == log_fd_generation ? min(state->log_blocks_count, SERVER_LOG_MAX_PENDING) : 0; // otherwise the blocks are in a log this process hasn't opened (yet)
+        blocks->records = blocks->old_records + (blocks->count ? state->log_records : 0);
+        memcpy(blocks->old, state->old_log_blocks, blocks->old_count * sizeof(log_block_t));
+        memcpy(blocks->current, state->log_blocks, blocks->count * sizeof(log_block_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&state->log_seq, __ATOMIC_RELAXED) == seq)
+            return;
+    }
+}
+
+// the data of a monitor consists of the stats_t in the data file, of which the first ones are in the segments instead (only if SERVER_COLUMNAR_SEGMENTS is enabled, otherwise segments_fd is -1), followed by the old blocks in log.old and the blocks in the log (only if SERVER_LOG_STRUCTURED is enabled and state isn't NULL)
+uint32 data_count(int fd, int segments_fd, int segment_offsets_fd, const monitor_state_t *state) {
+    uint32 records, sealed;
+    log_blocks_t blocks;
+    if (hot_tail_records(state, &records))
+        return records;
+    sealed = segments_count(segments_fd, segment_offsets_fd) * SEGMENT_RECORDS;
+    if (!SERVER_LOG_STRUCTURED || !state)
+        return max(fd_size(fd) / sizeof(stats_t), sealed);
+    log_blocks_read(state, fd, &records, &blocks);
+    return max(records, sealed) + blocks.records;
+}
+
+uint32 log_block_read(int fd, const log_block_t *block, uint32 pos, stats_t *buf, uint32 count) {
+    int32 read_len = pread(fd, buf, min(count, block->count - pos) * sizeof(stats_t), block->offset + pos * sizeof(stats_t));
+    return read_len > 0 ? read_len / sizeof(stats_t) : 0;
+}
+
+// reads up to count stats_t starting at pos, returns how many were read (less than count doesn't mean that the end was reached, only 0 does)
+uint32 data_read(int fd, int segments_fd, int segment_offsets_fd, const monitor_state_t *state, uint32 pos, stats_t *buf, uint32 count) {
+    uint32 sealed, records;
+    int32 read_len;
+    if ((records = hot_tail_read(state, pos, buf, count)))
+        return records;
+retry:
+    sealed = segments_count(segments_fd, segment_offsets_fd) * SEGMENT_RECORDS;
+    if (pos < sealed) {
+        segment_t segment;
+        if (!segment_read(segments_fd, segment_offsets_fd, pos / SEGMENT_RECORDS, &segment))
+            return 0;
+        count = min(count, SEGMENT_RECORDS - pos % SEGMENT_RECORDS);
+        segment_to_stats(&segment, buf, pos % SEGMENT_RECORDS, count);
+        return count;
+    }
+    if (pos < (records = fd_size(fd) / sizeof(stats_t))) {
+        if ((read_len = pread(fd, buf, min(count, records - pos) * sizeof(stats_t), pos * sizeof(stats_t))) <= 0)
+            return 0;
+        for (records = 0; records < read_len / sizeof(stats_t) && buf[records].time; ++records); // zeros are the hole of stats_t that were just sealed (the time is never 0)
+        if (!records && segments_count(segments_fd, segment_offsets_fd) * SEGMENT_RECORDS > pos)
+            goto retry;
+        return records;
+    }
+    if (!SERVER_LOG_STRUCTURED || !state)
+        return 0;
+    log_blocks_t blocks;
+    log_blocks_read(state, fd, &records, &blocks);
+    if (pos < max(records, sealed)) // log_compact() just appended the blocks to the data file
+        goto retry;
+    pos -= max(records, sealed);
+    for (uint8 i = 0; i < blocks.old_count; pos -= blocks.old[i++].count)
+        if (pos < blocks.old[i].count)
+            return log_block_read(old_log_fd, blocks.old + i, pos, buf, count); // the old log isn't changed anymore, so the blocks can still be read after log_compact() moved them
+    for (uint8 i = 0; i < blocks.count; pos -= blocks.current[i++].count)
+        if (pos < blocks.current[i].count)
+            return log_block_read(log_fd, blocks.current + i, pos, buf, count);
+    return 0;
+}
+
+void data_map_close(data_map_t *map) {
+    if (map->map)
+        munmap((void *)map->map, map->len);
+    map->map = NULL;
+}
+
+bool data_map(data_map_t *map, int fd, uint32 pos) { // maps the data file from pos on (at most DATA_MAP_MAX_SIZE), false if pos isn't in it
+    uint32 records = fd_size(fd) / sizeof(stats_t), offset = (pos * sizeof(stats_t)) & ~(uint32)(DATA_MAP_ALIGN - 1), end = min(records * sizeof(stats_t), offset + DATA_MAP_MAX_SIZE);
+    void *mapped;
+    data_map_close(map);
+    if (pos >= records || (mapped = mmap(NULL, end - offset, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, offset)) == MAP_FAILED)
+        return false;
+    madvise(mapped, end - offset, MADV_SEQUENTIAL);
+    map->map = mapped;
+    map->len = end - offset;
+    map->first = pos;
+    map->count = (end - pos * sizeof(stats_t)) / sizeof(stats_t);
+    map->stats = (const stats_t *)(map->map + pos * sizeof(stats_t) - offset);
+    return true;
+}
+
+// like data_read(), but returns a pointer to up to *count stats_t at pos (*count is set to how many, 0 at the end) in a read-only mapping of the data file, so that they don't have to be copied. The mapping is moved on (and thereby extended if the file grew) when pos leaves it. The ones in the hot tail, the segments and the log are read into buf instead (which needs space for *count). Only without SERVER_COLUMNAR_SEGMENTS, as sealing replaces the stats_t in the data file with a hole, which would change them in the mapping while they are used.
+const stats_t *data_map_read(data_map_t *map, int fd, int segments_fd, int segment_offsets_fd, const monitor_state_t *state, uint32 pos, stats_t *buf, uint32 *count) {
+    uint32 read_count = hot_tail_read(state, pos, buf, *count);
+    if (!read_count && segments_fd == -1 && ((map->map && pos >= map->first && pos < map->first + map->count) || data_map(map, fd, pos))) {
+        *count = min(*count, map->first + map->count - pos);
+        return map->stats + (pos - map->first);
+    }
+    *count = read_count ? read_count : data_read(fd, segments_fd, segment_offsets_fd, state, pos, buf, *count);
+    return buf;
+}
+
+// moves all complete blocks of SEGMENT_RECORDS stats_t after the sealed ones from the data file to the segment file. The data file keeps its size, the moved stats_t are only replaced with a hole (once the segments are synced), so that nothing is lost if this is interrupted and a stats_t is always at its index in the data file. Readers may read the zeros of the hole, see data_read().
+void segments_seal(int fd, int segments_fd, int segment_offsets_fd) {
+    stats_t stats[SEGMENT_RECORDS];
+    segment_t segment;
+    uint32 count = fd_size(fd) / sizeof(stats_t), sealed = segments_count(segments_fd, segment_offsets_fd) * SEGMENT_RECORDS, pos = sealed;
+    for (; pos + SEGMENT_RECORDS <= count; pos += SEGMENT_RECORDS) {
+        if (pread(fd, stats, sizeof(stats), pos * sizeof(stats_t)) != sizeof(stats))
+            break;
+        segment_from_stats(&segment, stats);
+        if (!segment_append(segments_fd, segment_offsets_fd, &segment))
+            break; // the rest stays in the data file
+    }
+    if (pos == sealed || (SERVER_GROUP_COMMIT_FSYNC && (fdatasync(segments_fd) || (segment_offsets_fd != -1 && fdatasync(segment_offsets_fd)))))
+        return;
+    syscall(__NR_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)0, (off_t)pos * sizeof(stats_t)); // frees the storage of all sealed ones (if the file system supports it), the earlier ones are already a hole unless the last call failed
+}
+
+// writes the stats_t of the segments (if include_segments, otherwise a hole in their place) and of the data file (only the ones newer than the segments, the older ones are in the segments too) to {TOKEN}.tmp and replaces the data file with it
+bool segments_rewrite_data_file(const char *token, int segments_fd, int segment_offsets_fd, bool include_segments) {
+    char tmp_name[37];
+    stats_t stats[SEGMENT_RECORDS];
+    segment_t segment;
+    int fd, tmp_fd;
+    uint32 last_time = segments_last_time(segments_fd, segment_offsets_fd), pos = 0, count, segments = segments_count(segments_fd, segment_offsets_fd);
+    monitor_file_name(tmp_name, token, ".tmp");
+    if ((tmp_fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+        return false;
+    if (!include_segments && (ftruncate(tmp_fd, (off_t)segments * SEGMENT_RECORDS * sizeof(stats_t)) || lseek(tmp_fd, 0, SEEK_END) == -1))
+        goto err;
+    for (; include_segments && pos < segments; ++pos) {
+        if (!segment_read(segments_fd, segment_offsets_fd, pos, &segment))
+            goto err;
+        segment_to_stats(&segment, stats, 0, SEGMENT_RECORDS);
+        if (write(tmp_fd, stats, sizeof(stats)) != sizeof(stats))
+            goto err;
+    }
+    if ((fd = open(token, O_RDONLY)) != -1) {
+        int32 read_len;
+        for (pos = 0; (read_len = pread(fd, stats, sizeof(stats), pos * sizeof(stats_t))) >= (int32)sizeof(stats_t); pos += count) // not data_read(), which stops at the hole
+            for (uint16 i = 0; i < (count = read_len / sizeof(stats_t)); ++i)
+                if (stats[i].time > last_time && write(tmp_fd, stats + i, sizeof(stats_t)) != sizeof(stats_t)) {
+                    close(fd);
+                    goto err;
+                }
+        close(fd);
+    }
+    if (fsync(tmp_fd) || rename(tmp_name, token))
+        goto err;
+    close(tmp_fd);
+    return true;
+err:
+    close(tmp_fd);
+    unlink(tmp_name);
+    return false;
+}
+
+// has to be called before any files are opened (it's done before the other processes are started): if SERVER_COLUMNAR_SEGMENTS is disabled or SERVER_COMPRESSED_SEGMENTS was changed, existing segments are converted back to a normal data file (and converted to the new format by load_totals()), otherwise data files which only contain the stats_t after the segments (as they were before the sealed ones were replaced with a hole) are converted
+void segments_prepare(void) {
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    if (!dir)
+        return;
+    while ((entry = readdir(dir))) {
+        char token[33], name[37];
+        int segments_fd, segment_offsets_fd, fd;
+        stats_t last;
+        uint32 segments_len, last_time;
+        if (strlen(entry->d_name) != 36 || (memcmp(entry->d_name + 32, SLEN(".seg")) && memcmp(entry->d_name + 32, SLEN(".sgo"))))
+            continue;
+        memcpy(token, entry->d_name, 32);
+        token[32] = '\0';
+        monitor_file_name(name, token, ".seg");
+        if (!memcmp(entry->d_name + 32, SLEN(".sgo"))) {
+            if (access(name, F_OK)) // left over from a crash while converting
+                unlink(entry->d_name);
+            continue;
+        }
+        if ((segments_fd = open(entry->d_name, O_RDWR)) == -1)
+            continue;
+        monitor_file_name(name, token, ".sgo");
+        segments_len = fd_size(segments_fd);
+        if ((segment_offsets_fd = open(name, O_RDWR)) == -1) {
+            if (segments_len % sizeof(segment_t)) // incomplete write
+                ftruncate(segments_fd, segments_len - segments_len % sizeof(segment_t));
+        } else {
+            uint32 offsets_len = fd_size(segment_offsets_fd), end = 0, segment_len;
+            segment_t segment;
+            if (offsets_len % sizeof(uint32)) // incomplete write
+                ftruncate(segment_offsets_fd, offsets_len -= offsets_len % sizeof(uint32));
+            if (offsets_len && pread(segment_offsets_fd, &end, sizeof(uint32), offsets_len - sizeof(uint32)) == sizeof(uint32)) {
+                if ((segment_len = segment_read(segments_fd, segment_offsets_fd, offsets_len / sizeof(uint32) - 1, &segment)))
+                    end += segment_len;
+                else // incomplete, which isn't possible unless the file system lost data, the data of this segment is lost
+                    ftruncate(segment_offsets_fd, offsets_len - sizeof(uint32));
+            }
+            if (segments_len != end) // a segment without offset (incomplete write)
+                ftruncate(segments_fd, end);
+        }
+        if (!SERVER_COLUMNAR_SEGMENTS || (segment_offsets_fd != -1) != (SERVER_COMPRESSED_SEGMENTS != 0)) {
+            if (!segments_rewrite_data_file(token, segments_fd, segment_offsets_fd, true))
+                goto err;
+            unlink(entry->d_name);
+            if (segment_offsets_fd != -1)
+                unlink(name);
+        } else if ((last_time = segments_last_time(segments_fd, segment_offsets_fd)) && (fd = open(token, O_RDONLY)) != -1) {
+            uint32 sealed = segments_count(segments_fd, segment_offsets_fd) * SEGMENT_RECORDS;
+            bool convert = fd_size(fd) / sizeof(stats_t) < sealed || pread(fd, &last, sizeof(stats_t), (sealed - 1) * sizeof(stats_t)) != sizeof(stats_t) || (last.time && last.time != last_time); // the last sealed one is either a hole or the last one of the segments
+            close(fd);
+            if (convert && !segments_rewrite_data_file(token, segments_fd, segment_offsets_fd, false))
+                goto err;
+        }
+        if (segment_offsets_fd != -1)
+            close(segment_offsets_fd);
+        close(segments_fd);
+    }
+    closedir(dir);
+    return;
+err:
+    write(2, SLEN("Error: can't convert the columnar segments (see SERVER_COLUMNAR_SEGMENTS and SERVER_COMPRESSED_SEGMENTS).\n"));
+    _exit(10);
+}
+
+void monitor_open_files(monitor_details_t *monitor) {
+    char name[37];
+    monitor->files_open = true;
+    ++open_monitors;
+    monitor->segments_fd = monitor->segment_offsets_fd = -1;
+    if (SERVER_COLUMNAR_SEGMENTS && SERVER_COMPRESSED_SEGMENTS) { // before the segment file, so that segments_prepare() never sees compressed segments without offsets
+        monitor_file_name(name, monitor->token, ".sgo");
+        monitor->segment_offsets_fd = open_with_retries(name, O_RDWR | O_CREAT | O_APPEND);
+    }
+    if (SERVER_COLUMNAR_SEGMENTS) {
+        monitor_file_name(name, monitor->token, ".seg");
+        monitor->segments_fd = open_with_retries(name, O_RDWR | O_CREAT | O_APPEND);
+    }
+    monitor->fd = open_with_retries(monitor->token, O_RDWR | O_CREAT | O_APPEND);
+    monitor_file_name(name, monitor->token, ".idx");
+    monitor->time_index_fd = open_with_retries(name, O_RDWR | O_CREAT | O_APPEND);
+    for (uint8 tier = 0; tier < ROLLUP_TIERS; ++tier) {
+        monitor_file_name(name, monitor->token, rollup_tier_suffixes[tier]);
+        monitor->rollup_fds[tier] = open_with_retries(name, O_RDWR | O_CREAT | O_APPEND);
+    }
+}
+
+void monitor_close_files(monitor_details_t *monitor) {
+    monitor->files_open = false;
+    --open_monitors;
+    close(monitor->fd);
+    if (monitor->segments_fd != -1)
+        close(monitor->segments_fd);
+    if (monitor->segment_offsets_fd != -1)
+        close(monitor->segment_offsets_fd);
+    close(monitor->time_index_fd);
+    for (uint8 tier = 0; tier < ROLLUP_TIERS; ++tier)
+        close(monitor->rollup_fds[tier]);
+}
+
+// opens the files of monitor (which has to be in details) if they aren't open. If SERVER_MAX_OPEN_MONITORS monitors have open files, the ones of a monitor that wasn't used recently (the clock algorithm) are closed, but never while a child may still use them.
+void monitor_use_files(monitor_details_t *monitor) {
+    monitor->files_used = true;
+    if (monitor->files_open)
+        return;
+    if (open_monitors >= SERVER_MAX_OPEN_MONITORS) {
+        struct timespec monotonic_time;
+        clock_gettime(CLOCK_MONOTONIC, &monotonic_time);
+        for (uint32 checked = 0; open_monitors >= SERVER_MAX_OPEN_MONITORS && checked < details_count * 2; ++checked) { // the first round may only clear files_used; if children use them, more monitors than the limit have open files for a moment
+            monitor_details_t *candidate = &details[files_clock++ % details_count];
+            if (!candidate->files_open || candidate->files_in_use_until > monotonic_time.tv_sec)
+                continue;
+            if (candidate->files_used) {
+                candidate->files_used = false;
+                continue;
+            }
+            monitor_close_files(candidate);
+        }
+    }
+    monitor_open_files(monitor);
+}
+
+void time_index_add(monitor_details_t *monitor, const stats_t *element) { // has to be called for every stats_t appended to the data file, before it is added to the totals
+    monitor_state_t *state = monitor->state;
+    if (!(state->records++ % TIME_INDEX_BLOCK)) {
+        time_index_entry_t entry = { element->time, { state->rx_total, state->tx_total, state->sectors_read_total, state->sectors_written_total } };
+        write(monitor->time_index_fd, &entry, sizeof(time_index_entry_t));
+    }
+}
+
+// returns the position of the first stats_t with a time >= time, assuming the data is sorted by time (which it is unless the time of an agent went backwards)
+uint32 time_index_find(monitor_details_t *monitor, int64 time) {
+    stats_t block[TIME_INDEX_BLOCK];
+    uint32 low = 0, high, block_time, count;
+    if (hot_tail_find(monitor->state, time, &low))
+        return low;
+    high = fd_size(monitor->time_index_fd) / sizeof(time_index_entry_t);
+    while (low < high) { // the first block that starts at or after time, so time is in the block before
+        uint32 mid = low + (high - low) / 2;
+        if (pread(monitor->time_index_fd, &block_time, sizeof(uint32), mid * sizeof(time_index_entry_t)) != sizeof(uint32)) // the time is the first member
+            break;
+        if (block_time < time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (!low)
+        return 0;
+    uint32 pos = (low - 1) * TIME_INDEX_BLOCK;
+    if (!(count = data_read(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state, pos, block, TIME_INDEX_BLOCK))) // one call is enough as TIME_INDEX_BLOCK == SEGMENT_RECORDS
+        return pos;
+    for (uint16 i = 0; i < count; ++i)
+        if (block[i].time >= time)
+            return pos + i;
+    return pos + count;
+}
+
+uint16 centroid_rate_encode(uint64 value) { // like a float with a 6-bit exponent and a 10-bit mantissa: exact below 2048, otherwise at most 0.1% off, the order is kept
+    if (value < 1024)
+        return value;
+    uint8 exponent = 63 - __builtin_clzll(value); // 10 to 63
+    return (exponent - 9) << 10 | ((value >> (exponent - 10)) & 1023);
+}
+
+uint64 centroid_rate_decode(uint16 mean) {
+    if (mean < 1024)
+        return mean;
+    uint8 shift = (mean >> 10) - 1;
+    return ((uint64)(1024 | (mean & 1023)) << shift) + (shift ? (uint64)1 << (shift - 1) : 0); // the middle of the values with this mean
+}
+
+void centroids_add(centroid_t *centroids, uint64 value, bool rate) { // adds value (a percentage in hundredths or a rate) to a t-digest of ROLLUP_CENTROIDS centroids; when all are used, the two neighbours whose merge costs the least accuracy are merged first, which (like in every t-digest) are those near the median rather than at the tails
+    uint8 used = 0, pos;
+    uint16 mean = rate ? centroid_rate_encode(value) : value;
+    uint32 total = 0;
+    for (; used < ROLLUP_CENTROIDS && centroids[used].count; ++used) {
+        if (centroids[used].mean == mean && centroids[used].count < UINT16_MAX) {
+            ++centroids[used].count;
+            return;
+        }
+        total += centroids[used].count;
+    }
+    if (used == ROLLUP_CENTROIDS) {
+        uint32 before = 0;
+        uint8 best = ROLLUP_CENTROIDS;
+        double best_cost = 0.0;
+        for (uint8 i = 0; i + 1 < used; before += centroids[i++].count) {
+            uint32 merged = centroids[i].count + centroids[i + 1].count;
+            double q = (before + merged / 2.0) / total, cost = merged / (q * (1.0 - q)); // a centroid at quantile q should contain at most around total * q * (1 - q) values
+            if (merged <= UINT16_MAX && (best == ROLLUP_CENTROIDS || cost < best_cost))
+                best = i, best_cost = cost;
+        }
+        if (best == ROLLUP_CENTROIDS) // can't occur unless there are more than ROLLUP_CENTROIDS * 32767 values
+            return;
+        uint32 merged = centroids[best].count + centroids[best + 1].count;
+        if (rate)
+            centroids[best].mean = centroid_rate_encode(((double)centroid_rate_decode(centroids[best].mean) * centroids[best].count + (double)centroid_rate_decode(centroids[best + 1].mean) * centroids[best + 1].count) / merged + 0.5);
+        else
+            centroids[best].mean = ((double)centroids[best].mean * centroids[best].count + (double)centroids[best + 1].mean * centroids[best + 1].count) / merged + 0.5;
+        centroids[best].count = merged;
+        memmove(centroids + best + 1, centroids + best + 2, (used - best - 2) * sizeof(centroid_t));
+        --used;
+    }
+    for (pos = used; pos && centroids[pos - 1].mean > mean; --pos)
+        centroids[pos] = centroids[pos - 1];
+    centroids[pos].mean = mean;
+    centroids[pos].count = 1;
+}
+
+uint32 rollups_count(int fd) { // of a rollup file
+    uint32 len = fd_size(fd);
+    return len > sizeof(rollup_header_t) ? (len - sizeof(rollup_header_t)) / sizeof(rollup_t) : 0;
+}
+
+// adds element to the current interval of every rollup tier, an interval is written when the first element of the next one is added; elements before written_until[tier] are skipped (only used by load_totals(), otherwise NULL)
+void rollups_add(monitor_details_t *monitor, const stats_t *element, uint32 *written_until) {
+    monitor_state_t *state = monitor->state;
+    uint32 time_diff = state->rollup_last_time ? element->time - state->rollup_last_time : CONFIG_MEASURE_EVERY_N_SECONDS;
+    if (!time_diff || time_diff > 32 * (1 + 3)) // like api_data() with one element per datapoint
+        time_diff = CONFIG_MEASURE_EVERY_N_SECONDS;
+    state->rollup_last_time = element->time;
+    uint16 percent[6] = { TO_HUNDREDTHS(element->cpu_usage), TO_HUNDREDTHS(element->cpu_iowait), TO_HUNDREDTHS(element->cpu_steal), TO_HUNDREDTHS(element->ram_usage), TO_HUNDREDTHS(element->swap_usage), TO_HUNDREDTHS(element->disk_usage) };
+    uint64 bytes[4] = { element->rx_bytes, element->tx_bytes, element->read_sectors * SECTOR_SIZE, element->written_sectors * SECTOR_SIZE },
+           rate[4] = { element->rx_bytes / time_diff, element->tx_bytes / time_diff, SECTOR_SIZE * (element->read_sectors / time_diff), SECTOR_SIZE * (element->written_sectors / time_diff) };
+    for (uint8 tier = 0; tier < ROLLUP_TIERS; ++tier) {
+        if (written_until && element->time < written_until[tier])
+            continue;
+        rollup_t *rollup = &state->rollups[tier];
+        uint32 start = element->time - element->time % rollup_tier_seconds[tier];
+        if (rollup->count && start > rollup->time) { // older elements (which shouldn't occur) are added to the current interval
+            if (write(monitor->rollup_fds[tier], rollup, sizeof(rollup_t)) != (int32)sizeof(rollup_t)) // the interval is missing then, but a partially written one would shift all following ones
+                ftruncate(monitor->rollup_fds[tier], ROLLUP_OFFSET(rollups_count(monitor->rollup_fds[tier])));
+            rollup->count = 0;
+        }
+        if (!rollup->count) {
+            memset(rollup, 0, sizeof(rollup_t));
+            rollup->time = start;
+            memset(rollup->percent_min, 0xff, sizeof(rollup->percent_min));
+            memset(rollup->rate_min, 0xff, sizeof(rollup->rate_min));
+        }
+        ++rollup->count;
+        rollup->time_sum += element->time;
+        for (uint8 i = 0; i < 6; ++i) {
+            rollup->percent_sum[i] += percent[i];
+            rollup->percent_min[i] = min(rollup->percent_min[i], percent[i]);
+            rollup->percent_max[i] = max(rollup->percent_max[i], percent[i]);
+        }
+        for (uint8 i = 0; i < 4; ++i) {
+            rollup->bytes_sum[i] += bytes[i];
+            rollup->rate_sum[i] += rate[i];
+            rollup->rate_min[i] = min(rollup->rate_min[i], rate[i]);
+            rollup->rate_max[i] = max(rollup->rate_max[i], rate[i]);
+        }
+        for (uint8 i = 0; i < 10; ++i)
+            centroids_add(rollup->centroids[i], i < 6 ? percent[i] : rate[i - 6], i >= 6);
+    }
+}
+
+// also restores the current rollup intervals and writes the ones missing in the rollup files and the time index (e.g. after a crash or when they don't exist yet). Only the data after the last entry of the time index (and of the oldest current rollup interval) is read, the totals before it are stored in the entry.
+void load_totals(monitor_details_t *monitor) { // http_buf is used even though this is no HTTP, but this isn't problematic
+    monitor_state_t *state = monitor->state;
+    time_index_entry_t first, last = { 0, { 0, 0, 0, 0 } };
+    stats_t element;
+    data_map_t map = { NULL, 0, 0, 0, NULL };
+    hot_tail_write_begin(state); // so that the files are used meanwhile
+    state->hot_tail_count = 0;
+    data_file_recover(monitor->fd, segments_count(monitor->segments_fd, monitor->segment_offsets_fd) * SEGMENT_RECORDS); // before anything else is derived from its size
+    uint32 written_until[ROLLUP_TIERS], time_index_len = fd_size(monitor->time_index_fd), time_index_valid = min(time_index_len / sizeof(time_index_entry_t), (data_count(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state) + TIME_INDEX_BLOCK - 1) / TIME_INDEX_BLOCK);
+    if (time_index_valid && (pread(monitor->time_index_fd, &first, sizeof(time_index_entry_t), 0) != sizeof(time_index_entry_t) || first.totals[0] || first.totals[1] || first.totals[2] || first.totals[3] ||
+                             pread(monitor->time_index_fd, &last, sizeof(time_index_entry_t), (time_index_valid - 1) * sizeof(time_index_entry_t)) != sizeof(time_index_entry_t) ||
+                             !data_read(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state, (time_index_valid - 1) * TIME_INDEX_BLOCK, &element, 1) || element.time != last.time))
+        time_index_valid = 0; // doesn't match the data, e.g. a time index of an older version, which only contained the times
+    if (time_index_len != time_index_valid * sizeof(time_index_entry_t)) // incomplete write or the data file was truncated
+        ftruncate(monitor->time_index_fd, time_index_valid * sizeof(time_index_entry_t));
+    for (uint8 tier = 0; tier < ROLLUP_TIERS; ++tier) {
+        uint32 rollup_file_len = fd_size(monitor->rollup_fds[tier]);
+        rollup_header_t header;
+        rollup_t last_rollup;
+        state->rollups[tier].count = written_until[tier] = 0;
+        if (rollup_file_len < sizeof(rollup_header_t) || pread(monitor->rollup_fds[tier], &header, sizeof(rollup_header_t), 0) != sizeof(rollup_header_t) || header.magic != ROLLUP_MAGIC || header.rollup_size != sizeof(rollup_t)) { // new or of another format, it is rebuilt from the data
+            header = (rollup_header_t){ ROLLUP_MAGIC, sizeof(rollup_t) };
+            if (ftruncate(monitor->rollup_fds[tier], 0) || write(monitor->rollup_fds[tier], &header, sizeof(rollup_header_t)) != sizeof(rollup_header_t))
+                ftruncate(monitor->rollup_fds[tier], 0); // tried again when the server is started the next time
+            continue;
+        }
+        if ((rollup_file_len - sizeof(rollup_header_t)) % sizeof(rollup_t)) // incomplete write
+            ftruncate(monitor->rollup_fds[tier], rollup_file_len -= (rollup_file_len - sizeof(rollup_header_t)) % sizeof(rollup_t));
+        if (rollup_file_len > sizeof(rollup_header_t) && pread(monitor->rollup_fds[tier], &last_rollup, sizeof(rollup_t), rollup_file_len - sizeof(rollup_t)) == sizeof(rollup_t))
+            written_until[tier] = last_rollup.time + rollup_tier_seconds[tier];
+    }
+    uint32 pos = time_index_find(monitor, min(written_until[0], min(written_until[1], written_until[2]))), count;
+    if (time_index_valid && pos > (time_index_valid - 1) * TIME_INDEX_BLOCK)
+        pos = (time_index_valid - 1) * TIME_INDEX_BLOCK;
+    pos -= pos % TIME_INDEX_BLOCK;
+    if (pos != (time_index_valid - 1) * TIME_INDEX_BLOCK && (!pos || pread(monitor->time_index_fd, &last, sizeof(time_index_entry_t), (pos / TIME_INDEX_BLOCK) * sizeof(time_index_entry_t)) != sizeof(time_index_entry_t))) {
+        pos = 0;
+        memset(&last, 0, sizeof(time_index_entry_t));
+    }
+    state->rx_total = last.totals[0];
+    state->tx_total = last.totals[1];
+    state->sectors_read_total = last.totals[2];
+    state->sectors_written_total = last.totals[3];
+    state->records = pos;
+    state->rollup_last_time = pos && data_read(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state, pos - 1, &element, 1) ? element.time : 0; // for the rate of the first element
+    for (;;) {
+        count = sizeof(http_buf) / sizeof(stats_t);
+        const stats_t *stats = data_map_read(&map, monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state, pos, (stats_t *)http_buf, &count);
+        if (!count)
+            break;
+        pos += count;
         for (uint16 i = 0; i < count; ++i) {
-            stats_t *element = (stats_t *)http_buf + i;
-            monitor->rx_total += element->rx_bytes;
-            monitor->tx_total += element->tx_bytes;
-            monitor->sectors_read_total += element->read_sectors;
-            monitor->sectors_written_total += element->written_sectors;
+            const stats_t *element = stats + i;
+            if (state->records / TIME_INDEX_BLOCK < time_index_valid)
+                ++state->records;
+            else
+                time_index_add(monitor, element);
+            state->rx_total += element->rx_bytes;
+            state->tx_total += element->tx_bytes;
+            state->sectors_read_total += element->read_sectors;
+            state->sectors_written_total += element->written_sectors;
+            rollups_add(monitor, element, written_until);
+        }
+    }
+    data_map_close(&map);
+    state->newest_time = state->written_time = state->rollup_last_time; // rollups_add() was called for each stats_t
+    if (monitor->segments_fd != -1) // the data file is converted when SERVER_COLUMNAR_SEGMENTS is enabled for the first time
+        segments_seal(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd);
+    if (SERVER_HOT_TAIL_HOURS) {
+        stats_t *hot_tail = hot_tails + (state - monitor_states) * HOT_TAIL_RECORDS;
+        for (pos = state->records > HOT_TAIL_RECORDS ? state->records - HOT_TAIL_RECORDS : 0; pos < state->records; pos += count, state->hot_tail_count += count)
+            if (!(count = data_read(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, state, pos, hot_tail + pos % HOT_TAIL_RECORDS, min(state->records - pos, HOT_TAIL_RECORDS - pos % HOT_TAIL_RECORDS)))) {
+                state->hot_tail_count = 0; // it has to end at the newest one
+                break;
+            }
+    }
+    hot_tail_write_end(state);
+}
+
+void spin_lock(_Atomic bool *lock) {
+    while (__atomic_exchange_n(lock, true, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+void spin_unlock(_Atomic bool *lock) {
+    __atomic_store_n(lock, false, __ATOMIC_RELEASE);
+}
+
+uint32 monitor_state_slot(const char token[32]) { // the slot of token in monitor_states_index, or the empty one where it would be inserted; monitor_states_lock has to be held
+    uint32 slot = token_hash(token) & (SERVER_MAX_MONITORS * 2 - 1);
+    while (monitor_states_index[slot] && memcmp(monitor_states[monitor_states_index[slot] - 1].token, token, 32))
+        slot = (slot + 1) & (SERVER_MAX_MONITORS * 2 - 1);
+    return slot;
+}
+
+monitor_state_t *monitor_state_find(const char token[32]) { // NULL if no worker initialized the state yet (or it is still being loaded)
+    spin_lock(monitor_states_lock);
+    uint32 slot = monitor_state_slot(token);
+    monitor_state_t *state = monitor_states_index[slot] ? &monitor_states[monitor_states_index[slot] - 1] : NULL;
+    if (state && __atomic_load_n(&state->loading, __ATOMIC_ACQUIRE))
+        state = NULL;
+    spin_unlock(monitor_states_lock);
+    return state;
+}
+
+void monitor_state_wait_loaded(monitor_state_t *state) {
+    while (__atomic_load_n(&state->loading, __ATOMIC_ACQUIRE))
+        usleep(500);
+}
+
+void monitor_state_clear_log(monitor_state_t *state) {
+    spin_lock(&state->lock);
+    log_write_begin(state);
+    state->log_blocks_count = state->old_log_blocks_count = 0;
+    state->log_records = state->old_log_records = 0;
+    log_write_end(state);
+    spin_unlock(&state->lock);
+}
+
+// the monitor states are shared between all workers, whichever worker sees a monitor first initializes its state; the slot is reserved under monitor_states_lock, but the files are read without it, so that the other monitors can be acquired meanwhile
+void monitor_state_acquire(monitor_details_t *monitor) {
+    spin_lock(monitor_states_lock);
+    uint32 slot = monitor_state_slot(monitor->token);
+    if (monitor_states_index[slot]) {
+        monitor->state = &monitor_states[monitor_states_index[slot] - 1];
+        if (!monitor->state->deleted) {
+            spin_unlock(monitor_states_lock);
+            monitor_state_wait_loaded(monitor->state);
+            return;
         }
+    } else {
+        uint32 id = __atomic_load_n(monitor_states_used, __ATOMIC_RELAXED);
+        if (id == SERVER_MAX_MONITORS) {
+            write(2, SLEN("Error: SERVER_MAX_MONITORS reached. Restart the server or increase it.\n"));
+            _exit(10);
+        }
+        __atomic_store_n(monitor_states_used, id + 1, __ATOMIC_RELAXED);
+        monitor->state = &monitor_states[id];
+        memcpy(monitor->state->token, monitor->token, 32);
+        monitor_states_index[slot] = id + 1;
     }
+    monitor->state->deleted = monitor->state->was_online = false;
+    monitor->state->time_diff = 0;
+    monitor_state_clear_log(monitor->state);
+    __atomic_store_n(&monitor->state->loading, true, __ATOMIC_RELAXED);
+    spin_unlock(monitor_states_lock);
+    monitor_open_files(monitor); // only for load_totals(), so that not all files are open after the start
+    load_totals(monitor);
+    monitor_close_files(monitor);
+    __atomic_store_n(&monitor->state->loading, false, __ATOMIC_RELEASE);
+}
+
+void monitor_state_delete(monitor_details_t *monitor) {
+    monitor_state_wait_loaded(monitor->state); // so that load_totals() doesn't recreate the files
+    spin_lock(monitor_states_lock);
+    if (!monitor->state->deleted) { // only the first worker that notices the deletion removes the file
+        char name[37];
+        monitor->state->deleted = true;
+        monitor_state_clear_log(monitor->state); // the blocks in the logs are skipped by log_compact() and log_prepare()
+        unlink(monitor->token);
+        monitor_file_name(name, monitor->token, ".idx");
+        unlink(name);
+        monitor_file_name(name, monitor->token, ".seg");
+        unlink(name);
+        monitor_file_name(name, monitor->token, ".sgo");
+        unlink(name);
+        for (uint8 tier = 0; tier < ROLLUP_TIERS; ++tier) {
+            monitor_file_name(name, monitor->token, rollup_tier_suffixes[tier]);
+            unlink(name);
+        }
+    }
+    spin_unlock(monitor_states_lock);
 }
 
 #define HIDE_KEY_CASE(_str, _key) \
@@ -155,37 +1144,30 @@ bool parse_data_json(void) {
     if (!data_json || !json_object_is_type(data_json, json_type_object) ||
         !json_object_object_get_ex(data_json, "monitors", &monitors) || !json_object_is_type(monitors, json_type_object))
         return false;
-    uint32 new_details_count = json_object_object_length(monitors);
+    uint32 new_details_count = json_object_object_length(monitors), new_index_slots = token_index_slots(new_details_count);
     if (proc == PROC_NOTIFICATIONS) {
         notification_monitor_details_t *new_details = NULL;
-        if (new_details_count && !(new_details = malloc(new_details_count * sizeof(notification_monitor_details_t))))
+        if (new_details_count && !(new_details = calloc(1, new_details_count * sizeof(notification_monitor_details_t) + new_index_slots * sizeof(uint32))))
             return false;
         MONITORS_FOREACH
                 if (MONITORS_FOREACH_TOKEN_CHECK || !(new_details[current_details_pos].name = json_object_array_get_idx(val, 1)) || !(new_details[current_details_pos].monitoring_settings = json_object_array_get_idx(val, 4))) {
-                    for (uint32 new_details_pos = 0; new_details_pos < current_details_pos; ++new_details_pos) // close fds of new monitors
-                        if (!get_notification_monitor_details_by_private(new_details[new_details_pos].token))
-                            close(new_details[new_details_pos].fd);
                     free(new_details);
                     return false;
                 }
                 memcpy(new_details[current_details_pos].token, token_str, 33); // also copy nullbyte
                 memcpy(new_details[current_details_pos].public_token, key, 33); // also copy nullbyte
                 notification_monitor_details_t *tmp_monitor;
-                if ((tmp_monitor = get_notification_monitor_details_by_private(token_str))) {
-                    new_details[current_details_pos].fd = tmp_monitor->fd;
+                if ((tmp_monitor = get_notification_monitor_details_by_private(token_str)))
                     memcpy(&new_details[current_details_pos].notification_sent, &tmp_monitor->notification_sent, sizeof(new_details[current_details_pos].notification_sent));
-                } else {
-                    new_details[current_details_pos].fd = open_with_retries(token_str, O_RDWR | O_CREAT | O_APPEND);
+                else
                     memset(&new_details[current_details_pos].notification_sent, 0, sizeof(new_details[current_details_pos].notification_sent));
-                }
         MONITORS_FOREACH_END
-        if (notification_details) {
-            for (uint32 details_pos = 0; details_pos < details_count; ++details_pos)
-                if (!json_object_object_get_ex(monitors, notification_details[details_pos].public_token, &tmp_json))
-                    close(notification_details[details_pos].fd);
+        for (uint32 pos = 0; pos < new_details_count; ++pos)
+            token_index_insert(PRIVATE_TOKEN_INDEX(new_details, new_details_count), new_index_slots - 1, new_details[pos].token, pos);
+        if (notification_details)
             free(notification_details);
-        }
         details_count = new_details_count;
+        token_index_mask = new_index_slots - 1;
         notification_details = new_details;
         return true;
     }
@@ -221,15 +1203,12 @@ bool parse_data_json(void) {
         return false; // if none of the cases matches
     }
     monitor_details_t *new_details = NULL;
-    if (new_details_count && !(new_details = malloc(new_details_count * sizeof(monitor_details_t))))
+    if (new_details_count && !(new_details = calloc(1, new_details_count * sizeof(monitor_details_t) + 2 * new_index_slots * sizeof(uint32))))
         return false;
     MONITORS_FOREACH
         json_object *is_public;
         if (MONITORS_FOREACH_TOKEN_CHECK || !(is_public = json_object_array_get_idx(val, 2)) || !json_object_is_type(is_public, json_type_boolean)) {
-            for (uint32 new_details_pos = 0; new_details_pos < current_details_pos; ++new_details_pos) // close fds of new monitors
-                if (!get_monitor_details_by_private(new_details[new_details_pos].token))
-                    close(new_details[new_details_pos].fd);
-            free(new_details);
+            free(new_details); // the files of new monitors aren't open yet
             return false;
         }
         memcpy(new_details[current_details_pos].token, token_str, 33); // also copy nullbyte
@@ -238,26 +1217,25 @@ bool parse_data_json(void) {
         monitor_details_t *tmp_monitor;
         if ((tmp_monitor = get_monitor_details_by_private(token_str))) {
             new_details[current_details_pos].fd = tmp_monitor->fd;
-            new_details[current_details_pos].was_online = tmp_monitor->was_online;
-            new_details[current_details_pos].rx_total = tmp_monitor->rx_total;
-            new_details[current_details_pos].tx_total = tmp_monitor->tx_total;
-            new_details[current_details_pos].sectors_read_total = tmp_monitor->sectors_read_total;
-            new_details[current_details_pos].sectors_written_total = tmp_monitor->sectors_written_total;
-            if (new_details[current_details_pos].was_online) {
-                new_details[current_details_pos].time_diff = tmp_monitor->time_diff;
-                memcpy(&new_details[current_details_pos].details, &tmp_monitor->details, sizeof(details_t));
-                memcpy(&new_details[current_details_pos].stats, &tmp_monitor->stats, sizeof(stats_t));
-            }
-        } else {
-            new_details[current_details_pos].was_online = false;
-            new_details[current_details_pos].fd = open_with_retries(token_str, O_RDWR | O_CREAT | O_APPEND);
-            load_totals(&new_details[current_details_pos]);
-        }
+            new_details[current_details_pos].time_index_fd = tmp_monitor->time_index_fd;
+            new_details[current_details_pos].segments_fd = tmp_monitor->segments_fd;
+            new_details[current_details_pos].segment_offsets_fd = tmp_monitor->segment_offsets_fd;
+            memcpy(new_details[current_details_pos].rollup_fds, tmp_monitor->rollup_fds, sizeof(tmp_monitor->rollup_fds));
+            new_details[current_details_pos].files_open = tmp_monitor->files_open;
+            new_details[current_details_pos].files_used = tmp_monitor->files_used;
+            new_details[current_details_pos].files_in_use_until = tmp_monitor->files_in_use_until;
+            new_details[current_details_pos].state = tmp_monitor->state;
+        } else
+            monitor_state_acquire(&new_details[current_details_pos]);
     MONITORS_FOREACH_END
+    for (uint32 pos = 0; pos < new_details_count; ++pos) {
+        token_index_insert(PRIVATE_TOKEN_INDEX(new_details, new_details_count), new_index_slots - 1, new_details[pos].token, pos);
+        token_index_insert(PUBLIC_TOKEN_INDEX(new_details, new_details_count, new_index_slots - 1), new_index_slots - 1, new_details[pos].public_token, pos);
+    }
     if (details) { // close_fds
         uint32 pos = close_fds_count, old_close_fds_count = close_fds_count;
         for (uint32 details_pos = 0; details_pos < details_count; ++details_pos)
-            if (!json_object_object_get_ex(monitors, details[details_pos].public_token, &tmp_json)) {
+            if (details[details_pos].files_open && !json_object_object_get_ex(monitors, details[details_pos].public_token, &tmp_json)) {
                 bool already_in_close_fds = false;
                 for (uint32 close_fds_pos = 0; close_fds_pos < old_close_fds_count; ++close_fds_pos) // shouldn't (can't?) occur, but better check than double-closing it...
                     if (close_fds[close_fds_pos].fd == details[details_pos].fd) {
@@ -265,7 +1243,7 @@ bool parse_data_json(void) {
                         break;
                     }
                 if (!already_in_close_fds)
-                    ++close_fds_count;
+                    close_fds_count += MONITOR_FILES;
             }
         if (close_fds_count > old_close_fds_count) {
             struct timespec monotonic_time;
@@ -279,18 +1257,14 @@ bool parse_data_json(void) {
                 close_fds = malloc(sizeof(close_fds_t) * close_fds_count);
                 if (!close_fds) {
 close_fds_alloc_err:
-                    if (new_details) {
-                        for (uint32 new_details_pos = 0; new_details_pos < new_details_count; ++new_details_pos) // close fds of new monitors
-                            if (!get_monitor_details_by_private(new_details[new_details_pos].token))
-                                close(new_details[new_details_pos].fd);
+                    if (new_details)
                         free(new_details);
-                    }
                     close_fds_count = old_close_fds_count;
                     return false;
                 }
             }
             for (uint32 details_pos = 0; details_pos < details_count; ++details_pos)
-                if (!json_object_object_get_ex(monitors, details[details_pos].public_token, &tmp_json)) {
+                if (details[details_pos].files_open && !json_object_object_get_ex(monitors, details[details_pos].public_token, &tmp_json)) {
                     bool already_in_close_fds = false;
                     for (uint32 close_fds_pos = 0; close_fds_pos < old_close_fds_count; ++close_fds_pos) // shouldn't (can't?) occur, but better check than double-closing it...
                         if (close_fds[close_fds_pos].fd == details[details_pos].fd) {
@@ -299,14 +1273,27 @@ close_fds_alloc_err:
                         }
                     if (!already_in_close_fds) {
                         close_fds[pos].fd = details[details_pos].fd;
-                        close_fds[pos].close_at = monotonic_time.tv_sec + 30;
-                        unlink(details[details_pos].token);
-                        ++pos;
+                        close_fds[pos++].close_at = monotonic_time.tv_sec + 30;
+                        close_fds[pos].fd = details[details_pos].time_index_fd;
+                        close_fds[pos++].close_at = monotonic_time.tv_sec + 30;
+                        close_fds[pos].fd = details[details_pos].segments_fd; // may be -1, which is skipped by check_close_fds()
+                        close_fds[pos++].close_at = monotonic_time.tv_sec + 30;
+                        close_fds[pos].fd = details[details_pos].segment_offsets_fd; // may be -1 as well
+                        close_fds[pos++].close_at = monotonic_time.tv_sec + 30;
+                        for (uint8 tier = 0; tier < ROLLUP_TIERS; ++tier) {
+                            close_fds[pos].fd = details[details_pos].rollup_fds[tier];
+                            close_fds[pos++].close_at = monotonic_time.tv_sec + 30;
+                        }
+                        --open_monitors;
                     }
                 }
         }
+        for (uint32 details_pos = 0; details_pos < details_count; ++details_pos)
+            if (!json_object_object_get_ex(monitors, details[details_pos].public_token, &tmp_json))
+                monitor_state_delete(&details[details_pos]);
     }
     details_count = new_details_count;
+    token_index_mask = new_index_slots - 1;
     if (details)
         free(details);
     details = new_details;
@@ -335,6 +1322,580 @@ void check_close_fds(void) {
     }
 }
 
+uint64 monotonic_ms(void) {
+    struct timespec monotonic_time;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic_time);
+    return (uint64)monotonic_time.tv_sec * 1000 + monotonic_time.tv_nsec / 1000000;
+}
+
+void connection_release(connection_t *conn) { // doesn't close the fd
+    conn->fd = -1;
+    connections_free[connections_free_count++] = conn - connections;
+}
+
+void connection_reset(connection_t *conn, uint64 timeout_ms) {
+    conn->len = conn->body = 0;
+    conn->content_length = 0;
+    conn->keep_alive = false;
+    conn->timeout_at = monotonic_ms() + timeout_ms;
+}
+
+bool connections_close_idle(void) { // makes room for a new connection by closing an idle keep-alive connection
+    for (uint32 i = 0; i < connections_used; ++i)
+        if (connections[i].fd != -1 && connections[i].idle) {
+            close(connections[i].fd);
+            connection_release(&connections[i]);
+            return true;
+        }
+    return false;
+}
+
+void connections_accept(int sock) {
+    int fd;
+    while ((fd = syscall(__NR_accept4, sock, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        unsigned int timeout = 50; // 50 ms, should be more than enough as the reverse proxy should be on the same machine
+        struct timeval timeout_struct = { .tv_sec = 0, .tv_usec = 50000 };
+        if ((!connections_free_count && !connections_close_idle()) ||
+            setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout_struct, sizeof(timeout_struct)) ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout_struct, sizeof(timeout_struct))) {
+            close(fd);
+            continue;
+        }
+        uint32 id = connections_free[--connections_free_count];
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.u32 = id };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            ++connections_free_count;
+            close(fd);
+            continue;
+        }
+        connections[id].fd = fd;
+        connections[id].idle = false;
+        connection_reset(&connections[id], SERVER_CONNECTION_TIMEOUT_MS);
+        if (id >= connections_used)
+            connections_used = id + 1;
+    }
+}
+
+void connections_check_timeouts(void) {
+    uint64 now = monotonic_ms();
+    for (uint32 i = 0; i < connections_used; ++i)
+        if (connections[i].fd != -1 && connections[i].timeout_at <= now) {
+            close(connections[i].fd);
+            connection_release(&connections[i]);
+        }
+    while (connections_used && connections[connections_used - 1].fd == -1)
+        --connections_used;
+}
+
+const char *connection_header(const char *buf, uint16 body, const char *name) { // name has to include the colon, returns the value (without leading spaces) or NULL
+    uint8 name_len = strlen(name);
+    for (uint16 pos = 0; pos + 1 + name_len < body; ++pos)
+        if (buf[pos] == '\n' && !strncasecmp(buf + pos + 1, name, name_len)) {
+            pos += 1 + name_len;
+            while (buf[pos] == ' ')
+                ++pos;
+            return buf + pos;
+        }
+    return NULL;
+}
+
+enum {
+    CONNECTION_WAIT,
+    CONNECTION_CLOSE,
+    CONNECTION_READY
+} PACKED connection_read(connection_t *conn) { // incremental, only the newly received part is parsed
+    char *buf = connection_bufs[conn - connections];
+    uint16 parsed_len = conn->len;
+    int32 tmp = -1;
+    if (conn->idle) { // the timeout for idle keep-alive connections is longer than the one for receiving a request
+        conn->idle = false;
+        conn->timeout_at = monotonic_ms() + SERVER_CONNECTION_TIMEOUT_MS;
+    }
+    while (conn->len < CONNECTION_BUF_SIZE - 1 && (tmp = read(conn->fd, buf + conn->len, CONNECTION_BUF_SIZE - 1 - conn->len)) > 0)
+        conn->len += tmp;
+    bool eof = !tmp || (tmp == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+    if (!conn->body) {
+        for (uint16 pos = max(parsed_len, 3); pos < conn->len; ++pos)
+            if (buf[pos] == '\n' && buf[pos - 2] == '\n' && buf[pos - 1] == '\r' && buf[pos - 3] == '\r') {
+                conn->body = pos + 1;
+                break;
+            }
+        if (conn->body && conn->len >= strlen("POST /submit ") && !memcmp(buf, SLEN("POST /submit "))) { // only uploads are handled in this process, so only they can use keep-alive
+            const char *value = connection_header(buf, conn->body, "content-length:"), *line_end = memchr(buf, '\r', conn->body);
+            if (!value || (conn->content_length = strtoul(value, NULL, 10)) > (uint32)(SUBMIT_MAX_SIZE - min(conn->body, SUBMIT_MAX_SIZE)))
+                return CONNECTION_CLOSE;
+            value = connection_header(buf, conn->body, "connection:");
+            conn->keep_alive = line_end - buf >= (int32)strlen("POST /submit HTTP/1.1") && !memcmp(line_end - strlen("HTTP/1.1"), SLEN("HTTP/1.1")) && (!value || strncasecmp(value, SLEN("close")));
+        }
+    }
+    if (conn->body && conn->len >= conn->body + conn->content_length)
+        return CONNECTION_READY;
+    return eof || conn->len == CONNECTION_BUF_SIZE - 1 ? CONNECTION_CLOSE : CONNECTION_WAIT;
+}
+
+// waits for the next complete request, which is then copied to http_buf, len and client. Returns false on timeouts so that the main loop can do its periodic work. The request has to be finished with request_done().
+bool next_request(int sock) {
+    static struct epoll_event events[EPOLL_MAX_EVENTS];
+    static int32 events_count = 0, events_pos = 0;
+    for (;;) {
+        if (events_pos >= events_count) {
+            if (connections_used)
+                connections_check_timeouts();
+            events_pos = 0;
+            int32 timeout = 100;
+            if (pending_writes_count) {
+                uint64 now = monotonic_ms();
+                if (now >= pending_writes_deadline)
+                    return false;
+                timeout = min(pending_writes_deadline - now, (uint64)timeout);
+            }
+            if ((events_count = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout)) <= 0) {
+                events_count = 0;
+                return false;
+            }
+        }
+        struct epoll_event *event = &events[events_pos++];
+        if (event->data.u32 == EPOLL_LISTEN_ID) {
+            connections_accept(sock);
+            continue;
+        }
+        connection_t *conn = connections + event->data.u32;
+        if (conn->fd == -1) // already closed because of a timeout
+            continue;
+        uint8 state = connection_read(conn);
+        if (state == CONNECTION_WAIT)
+            continue;
+        if (state == CONNECTION_CLOSE) {
+            close(conn->fd);
+            connection_release(conn);
+            continue;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL); // necessary as the fd may be passed on to a child
+        client = conn->fd;
+        len = conn->len;
+        if (conn->keep_alive && (uint32)len != conn->body + conn->content_length) { // pipelining isn't supported
+            conn->keep_alive = false;
+            len = conn->body + conn->content_length;
+        }
+        memcpy(http_buf, connection_bufs[conn - connections], len);
+        current_connection = conn;
+        return true;
+    }
+}
+
+enum {
+    REQUEST_CLOSE,
+    REQUEST_KEEP_ALIVE,
+    REQUEST_PASSED_ON // the fd now belongs to a child or a stream
+};
+
+void request_done(uint8 state) {
+    if (state == REQUEST_KEEP_ALIVE && current_connection->keep_alive) {
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.u32 = current_connection - connections };
+        connection_reset(current_connection, SERVER_KEEP_ALIVE_TIMEOUT_MS);
+        current_connection->idle = true;
+        if (!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &event))
+            return;
+    }
+    if (state != REQUEST_PASSED_ON)
+        close(client);
+    connection_release(current_connection);
+}
+
+void submit_done(bool success) { // answers the current upload and finishes the request
+    if (success && current_connection->keep_alive) {
+        if (sock_ready(client, false, 1) && write(client, SLEN("HTTP/1.1 200\r\nContent-Length: 1\r\n\r\n1")) == strlen("HTTP/1.1 200\r\nContent-Length: 1\r\n\r\n1")) {
+            request_done(REQUEST_KEEP_ALIVE);
+            return;
+        }
+    } else if (success && sock_ready(client, false, 1))
+        write(client, SLEN("HTTP/1.1 200\r\nContent-Length: 1\r\nConnection: close\r\n\r\n1"));
+    request_done(REQUEST_CLOSE);
+}
+
+int32 writev_all(int fd, struct iovec *iov, uint32 iov_count) { // returns the number of bytes written, modifies iov
+    int32 written = 0, tmp;
+    while (iov_count && (tmp = writev(fd, iov, iov_count)) > 0) {
+        written += tmp;
+        while (iov_count && (uint32)tmp >= iov->iov_len) {
+            tmp -= iov->iov_len;
+            ++iov;
+            --iov_count;
+        }
+        if (iov_count) {
+            iov->iov_base = (uint8 *)iov->iov_base + tmp;
+            iov->iov_len -= tmp;
+        }
+    }
+    return written;
+}
+
+void close_later(int fd) { // like the fds of deleted monitors, children may still use it
+    struct timespec monotonic_time;
+    close_fds_t *new_close_fds = realloc(close_fds, sizeof(close_fds_t) * (close_fds_count + 1));
+    if (!new_close_fds) // better keep it open than close it while it is used
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic_time);
+    close_fds = new_close_fds;
+    close_fds[close_fds_count].fd = fd;
+    close_fds[close_fds_count++].close_at = monotonic_time.tv_sec + 11; // children are terminated after 10 seconds
+}
+
+void log_reopen_if_rotated(void) { // another worker may have replaced the log with a new one
+    uint32 generation = __atomic_load_n(log_generation, __ATOMIC_ACQUIRE);
+    if (generation == log_fd_generation)
+        return;
+    close_later(log_fd);
+    if (old_log_fd != -1)
+        close_later(old_log_fd);
+    old_log_fd = open("log.old", O_RDONLY); // if it is already a newer one, the blocks of generation - 1 were moved to the data files already, so they aren't read from it
+    old_log_fd_generation = generation - 1;
+    log_fd = open_with_retries("log", O_RDWR | O_APPEND);
+    log_fd_generation = generation;
+}
+
+// renames the log to log.old and starts a new one, the blocks of the monitors become their old blocks (which log_compact() moves to the data files without log_lock); log_lock has to be held and log.old must not exist anymore
+bool log_rotate(void) {
+    int new_log_fd = open("log.tmp", O_RDWR | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+    if (new_log_fd == -1)
+        return false;
+    if (rename("log", "log.old")) {
+        close(new_log_fd);
+        return false;
+    }
+    if (rename("log.tmp", "log")) {
+        rename("log.old", "log");
+        close(new_log_fd);
+        return false;
+    }
+    uint32 used = __atomic_load_n(monitor_states_used, __ATOMIC_RELAXED);
+    for (uint32 id = 0; id < used; ++id) {
+        monitor_state_t *state = &monitor_states[id];
+        if (!state->log_blocks_count)
+            continue;
+        spin_lock(&state->lock);
+        log_write_begin(state);
+        memcpy(state->old_log_blocks, state->log_blocks, sizeof(state->log_blocks));
+        state->old_log_blocks_count = state->log_blocks_count;
+        state->old_log_records = state->log_records;
+        state->old_log_generation = state->log_generation;
+        state->log_blocks_count = 0;
+        state->log_records = 0;
+        log_write_end(state);
+        spin_unlock(&state->lock);
+    }
+    if (old_log_fd != -1)
+        close_later(old_log_fd);
+    old_log_fd = log_fd;
+    old_log_fd_generation = log_fd_generation;
+    log_fd = new_log_fd;
+    log_fd_generation = __atomic_add_fetch(log_generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(log_old_pending, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool log_blocks_append(int log, const log_block_t *blocks, uint8 count, int fd) { // to the data file fd, http_buf is used
+    uint32 len;
+    for (uint8 i = 0; i < count; ++i)
+        for (uint32 done = 0; done < blocks[i].count; done += len) {
+            len = min(blocks[i].count - done, sizeof(http_buf) / sizeof(stats_t));
+            if (pread(log, http_buf, len * sizeof(stats_t), blocks[i].offset + done * sizeof(stats_t)) != (int32)(len * sizeof(stats_t)) || write(fd, http_buf, len * sizeof(stats_t)) != (int32)(len * sizeof(stats_t)))
+                return false;
+        }
+    return true;
+}
+
+// moves the old blocks of all monitors from log.old to their data files and removes it if that worked for all of them, otherwise it is tried again by the next compaction; called by the worker that set log_compacting, without log_lock, so that uploads are appended to the new log meanwhile. http_buf is used like in load_totals().
+void log_compact(void) {
+    bool complete = old_log_fd != -1;
+    uint32 used = __atomic_load_n(monitor_states_used, __ATOMIC_RELAXED);
+    for (uint32 id = 0; old_log_fd != -1 && id < used; ++id) {
+        monitor_state_t *state = &monitor_states[id];
+        if (!state->old_log_blocks_count || state->deleted)
+            continue;
+        if (state->old_log_generation != old_log_fd_generation) { // this worker opened a newer log.old, shouldn't occur
+            complete = false;
+            continue;
+        }
+        monitor_details_t *monitor = get_monitor_details_by_private(state->token);
+        char token[33];
+        int fd;
+        memcpy(token, state->token, 32);
+        token[32] = '\0';
+        if (monitor) {
+            monitor_use_files(monitor);
+            fd = monitor->fd;
+        } else if ((fd = open(token, O_WRONLY | O_APPEND)) == -1) { // data.json was just changed and this worker didn't reload it yet
+            complete = false;
+            continue;
+        }
+        spin_lock(&state->lock);
+        log_write_begin(state);
+        uint32 file_len = fd_size(fd);
+        bool success = log_blocks_append(old_log_fd, state->old_log_blocks, state->old_log_blocks_count, fd) && (!SERVER_GROUP_COMMIT_FSYNC || !fdatasync(fd));
+        if (success) {
+            state->old_log_blocks_count = 0;
+            state->old_log_records = 0;
+        } else {
+            ftruncate(fd, file_len); // the blocks stay in log.old
+            complete = false;
+        }
+        log_write_end(state);
+        if (success && monitor && monitor->segments_fd != -1)
+            segments_seal(fd, monitor->segments_fd, monitor->segment_offsets_fd);
+        spin_unlock(&state->lock);
+        if (!monitor)
+            close(fd);
+    }
+    if (complete && !unlink("log.old"))
+        __atomic_store_n(log_old_pending, false, __ATOMIC_RELAXED);
+    __atomic_store_n(log_compacting, false, __ATOMIC_RELEASE);
+}
+
+// appends the blocks of the monitor in both logs to its data file, so that its uploads can be written to it directly; the state lock has to be held
+bool log_blocks_move(monitor_details_t *monitor) {
+    monitor_state_t *state = monitor->state;
+    uint32 file_len = fd_size(monitor->fd);
+    bool success;
+    if (state->old_log_blocks_count && (old_log_fd == -1 || state->old_log_generation != old_log_fd_generation))
+        return false;
+    log_write_begin(state);
+    success = log_blocks_append(old_log_fd, state->old_log_blocks, state->old_log_blocks_count, monitor->fd) && log_blocks_append(log_fd, state->log_blocks, state->log_blocks_count, monitor->fd);
+    if (success) {
+        state->log_blocks_count = state->old_log_blocks_count = 0;
+        state->log_records = state->old_log_records = 0;
+    } else
+        ftruncate(monitor->fd, file_len);
+    log_write_end(state);
+    return success;
+}
+
+// appends the pending writes to the log with one frame per monitor, the offset of the block of a monitor is stored in its first pending write; log_lock has to be held
+bool log_append_pending(void) {
+    static struct iovec iov[SERVER_GROUP_COMMIT_MAX_UPLOADS * 2];
+    static log_frame_t frames[SERVER_GROUP_COMMIT_MAX_UPLOADS];
+    struct timespec monotonic_time;
+    uint32 iov_count = 0, frames_count = 0, total_len = 0, offset = fd_size(log_fd);
+    bool full = offset >= LOG_MAX_SIZE - SERVER_GROUP_COMMIT_BUF_SIZE - SERVER_GROUP_COMMIT_MAX_UPLOADS * sizeof(log_frame_t), needed = full; // the log should be replaced now
+    clock_gettime(CLOCK_MONOTONIC, &monotonic_time);
+    for (uint32 i = 0; !needed && i < pending_writes_count; ++i)
+        if (pending_writes[i].monitor->state->log_blocks_count == SERVER_LOG_MAX_PENDING)
+            needed = true;
+    if ((needed || (uint64)monotonic_time.tv_sec >= __atomic_load_n(log_compact_at, __ATOMIC_RELAXED)) && !__atomic_exchange_n(log_compacting, true, __ATOMIC_ACQUIRE)) { // not while another worker still compacts log.old
+        __atomic_store_n(log_compact_at, monotonic_time.tv_sec + SERVER_LOG_COMPACT_SECONDS, __ATOMIC_RELAXED);
+        if (__atomic_load_n(log_old_pending, __ATOMIC_RELAXED) || log_rotate()) // if log.old is left over from a compaction that didn't work, only it is compacted (again)
+            log_compact_claimed = true;
+        else
+            __atomic_store_n(log_compacting, false, __ATOMIC_RELEASE);
+        offset = fd_size(log_fd);
+        full = offset >= LOG_MAX_SIZE - SERVER_GROUP_COMMIT_BUF_SIZE - SERVER_GROUP_COMMIT_MAX_UPLOADS * sizeof(log_frame_t);
+    }
+    for (uint32 i = 0; i < pending_writes_count; ++i) {
+        monitor_details_t *monitor = pending_writes[i].monitor;
+        uint32 y = 0;
+        while (y < i && pending_writes[y].monitor != monitor)
+            ++y;
+        if (y < i) // not the first pending write of the monitor
+            continue;
+        if (full || monitor->state->log_blocks_count == SERVER_LOG_MAX_PENDING) { // the log couldn't be replaced, so the uploads are written to the data file directly instead of waiting for the compaction
+            pending_writes[i].log_offset = 0;
+            continue;
+        }
+        log_frame_t *frame = &frames[frames_count++];
+        memcpy(frame->token, monitor->token, 32);
+        frame->count = 0;
+        frame->first_time = ((stats_t *)(pending_writes_buf + pending_writes[i].offset))->time;
+        iov[iov_count].iov_base = frame;
+        total_len += iov[iov_count++].iov_len = sizeof(log_frame_t);
+        pending_writes[i].log_offset = offset + total_len;
+        uint32 frame_iov = iov_count;
+        for (y = i; y < pending_writes_count; ++y)
+            if (pending_writes[y].monitor == monitor) {
+                frame->count += pending_writes[y].stats_count;
+                iov[iov_count].iov_base = pending_writes_buf + pending_writes[y].offset;
+                total_len += iov[iov_count++].iov_len = sizeof(stats_t) * pending_writes[y].stats_count;
+            }
+        frame->crc = crc32c(0, frame, sizeof(log_frame_t) - sizeof(uint32));
+        for (; frame_iov < iov_count; ++frame_iov)
+            frame->crc = crc32c(frame->crc, iov[frame_iov].iov_base, iov[frame_iov].iov_len);
+    }
+    if ((uint32)writev_all(log_fd, iov, iov_count) == total_len && (!SERVER_GROUP_COMMIT_FSYNC || !fdatasync(log_fd)))
+        return true;
+    ftruncate(log_fd, offset);
+    return false;
+}
+
+bool log_frame_valid(int fd, log_frame_t *frame, uint32 pos) { // pos is the offset of the stats_t of frame, http_buf is used
+    uint32 crc = crc32c(0, frame, sizeof(log_frame_t) - sizeof(uint32)), count;
+    for (uint32 done = 0; done < frame->count; done += count) {
+        count = min(frame->count - done, sizeof(http_buf) / sizeof(stats_t));
+        if (pread(fd, http_buf, count * sizeof(stats_t), pos + done * sizeof(stats_t)) != (int32)(count * sizeof(stats_t)) || (!done && ((stats_t *)http_buf)->time != frame->first_time))
+            return false;
+        crc = crc32c(crc, http_buf, count * sizeof(stats_t));
+    }
+    return crc == frame->crc;
+}
+
+// the uploads in a log that was left over (after a crash, or if SERVER_LOG_STRUCTURED was disabled) are appended to the data files, skipping the ones that are already in them (because a compaction was interrupted). Everything from the first incomplete or corrupted frame on was never acknowledged and is discarded.
+void log_replay(const char *name) {
+    log_frame_t frame;
+    uint32 pos = 0, len, count;
+    int fd = open(name, O_RDONLY);
+    if (fd == -1)
+        return;
+    len = fd_size(fd);
+    while (len - pos >= sizeof(log_frame_t) && pread(fd, &frame, sizeof(log_frame_t), pos) == sizeof(log_frame_t) && frame.count && frame.count <= (len - pos - sizeof(log_frame_t)) / sizeof(stats_t) && log_frame_valid(fd, &frame, pos + sizeof(log_frame_t))) {
+        char token[33], name[37];
+        int data_fd, segments_fd, segment_offsets_fd = -1;
+        uint32 data_len, last_time, sealed;
+        stats_t last;
+        pos += sizeof(log_frame_t);
+        memcpy(token, frame.token, 32);
+        token[32] = '\0';
+        if ((data_fd = open(token, O_RDWR | O_APPEND)) == -1) // the monitor was deleted
+            goto next;
+        monitor_file_name(name, token, ".seg");
+        if ((segments_fd = open(name, O_RDONLY)) != -1) {
+            monitor_file_name(name, token, ".sgo");
+            segment_offsets_fd = open(name, O_RDONLY);
+        }
+        sealed = segments_count(segments_fd, segment_offsets_fd) * SEGMENT_RECORDS;
+        if ((data_len = data_file_recover(data_fd, sealed)) > sealed * sizeof(stats_t) && pread(data_fd, &last, sizeof(stats_t), data_len - sizeof(stats_t)) == sizeof(stats_t))
+            last_time = last.time;
+        else
+            last_time = segments_last_time(segments_fd, segment_offsets_fd);
+        if (segment_offsets_fd != -1)
+            close(segment_offsets_fd);
+        if (segments_fd != -1)
+            close(segments_fd);
+        for (uint32 done = 0; done < frame.count; done += count) {
+            stats_t *stats = (stats_t *)http_buf;
+            uint32 kept = 0;
+            count = min(frame.count - done, sizeof(http_buf) / sizeof(stats_t));
+            if (pread(fd, http_buf, count * sizeof(stats_t), pos + done * sizeof(stats_t)) != (int32)(count * sizeof(stats_t)))
+                goto err;
+            for (uint32 i = 0; i < count; ++i)
+                if (stats[i].time > last_time)
+                    stats[kept++] = stats[i];
+            if (!kept)
+                continue;
+            last_time = stats[kept - 1].time;
+            if (write(data_fd, stats, kept * sizeof(stats_t)) != (int32)(kept * sizeof(stats_t)))
+                goto err;
+        }
+        if (SERVER_GROUP_COMMIT_FSYNC && fdatasync(data_fd))
+            goto err;
+        close(data_fd);
+next:
+        pos += frame.count * sizeof(stats_t);
+    }
+    close(fd);
+    unlink(name);
+    return;
+err:
+    write(2, SLEN("Error: can't move the uploads in the log to the data files (see SERVER_LOG_STRUCTURED).\n"));
+    _exit(10);
+}
+
+// has to be called before any files are opened and after segments_prepare()
+void log_prepare(void) {
+    log_replay("log.old"); // a compaction was interrupted, its uploads are older than the ones in the log
+    log_replay("log");
+}
+
+void pending_writes_flush(void) { // writes all buffered uploads with one writev() per monitor (or one in total if SERVER_LOG_STRUCTURED is enabled) and answers them
+    static struct iovec iov[SERVER_GROUP_COMMIT_MAX_UPLOADS];
+    bool log_success = false;
+    if (SERVER_LOG_STRUCTURED) { // held until the blocks were added to the states, otherwise the log could be replaced before
+        spin_lock(log_lock);
+        log_reopen_if_rotated();
+        log_success = log_append_pending();
+    }
+    for (uint32 i = 0; i < pending_writes_count; ++i) {
+        if (pending_writes[i].done)
+            continue;
+        monitor_details_t *monitor = pending_writes[i].monitor;
+        monitor_state_t *state = monitor->state;
+        uint32 iov_count = 0, total_len = 0, file_len;
+        for (uint32 y = i; y < pending_writes_count; ++y)
+            if (pending_writes[y].monitor == monitor) {
+                iov[iov_count].iov_base = pending_writes_buf + pending_writes[y].offset;
+                total_len += iov[iov_count++].iov_len = sizeof(stats_t) * pending_writes[y].stats_count;
+            }
+        monitor_use_files(monitor);
+        spin_lock(&state->lock);
+        bool success;
+        if (SERVER_LOG_STRUCTURED && pending_writes[i].log_offset) {
+            if ((success = log_success)) {
+                log_write_begin(state);
+                if (!state->log_blocks_count)
+                    state->log_generation = log_fd_generation;
+                state->log_blocks[state->log_blocks_count++] = (log_block_t){ pending_writes[i].log_offset, total_len / sizeof(stats_t) };
+                state->log_records += total_len / sizeof(stats_t);
+                log_write_end(state);
+            }
+        } else if ((success = !SERVER_LOG_STRUCTURED || log_blocks_move(monitor))) { // the stats_t in the logs come before the new ones
+            int32 written = writev_all(monitor->fd, iov, iov_count);
+            success = (uint32)written == total_len && (!SERVER_GROUP_COMMIT_FSYNC || !fdatasync(monitor->fd));
+            if (!success && written > 0 && (file_len = fd_size(monitor->fd)) >= (uint32)written)
+                ftruncate(monitor->fd, file_len - written); // try to remove the part that was already written
+        }
+        for (uint32 y = i; y < pending_writes_count; ++y) {
+            pending_write_t *pending = &pending_writes[y];
+            if (pending->monitor != monitor)
+                continue;
+            pending->done = true;
+            if (!success)
+                continue;
+            stats_t *ptr_stats = (stats_t *)(pending_writes_buf + pending->offset);
+            uint32 last_time = state->was_online ? state->stats.time : 0;
+            hot_tail_write_begin(state);
+            for (uint8 z = 0; z < pending->stats_count; ++z) {
+                time_index_add(monitor, ptr_stats + z);
+                hot_tail_add(state, ptr_stats + z);
+                state->rx_total += ptr_stats[z].rx_bytes;
+                state->tx_total += ptr_stats[z].tx_bytes;
+                state->sectors_read_total += ptr_stats[z].read_sectors;
+                state->sectors_written_total += ptr_stats[z].written_sectors;
+                rollups_add(monitor, ptr_stats + z, NULL);
+            }
+            hot_tail_write_end(state);
+            state->written_time = ptr_stats[pending->stats_count - 1].time;
+            if (pending->includes_details) {
+                state->was_online = true;
+                memcpy(&state->details, &pending->details, sizeof(details_t));
+                memcpy(&state->stats, ptr_stats + pending->stats_count - 1, sizeof(stats_t));
+                if (ptr_stats[pending->stats_count - 1].time - last_time > (uint32)min(CONFIG_MEASURE_EVERY_N_SECONDS * 1.2, CONFIG_MEASURE_EVERY_N_SECONDS + 1))
+                    state->time_diff = (CONFIG_MEASURE_EVERY_N_SECONDS + 1);
+                else
+                    state->time_diff = ptr_stats[pending->stats_count - 1].time - last_time;
+            }
+        }
+        if (success && monitor->segments_fd != -1)
+            segments_seal(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd);
+        if (success)
+            __atomic_add_fetch(&state->version, 1, __ATOMIC_RELEASE);
+        state->newest_time = max(state->newest_time, state->written_time);
+        if (!success)
+            state->newest_time = state->written_time; // so that the uploads can be sent again
+        spin_unlock(&state->lock);
+        for (uint32 y = i; y < pending_writes_count; ++y)
+            if (pending_writes[y].monitor == monitor) {
+                current_connection = pending_writes[y].conn;
+                client = current_connection->fd;
+                submit_done(success);
+            }
+    }
+    if (SERVER_LOG_STRUCTURED)
+        spin_unlock(log_lock);
+    pending_writes_count = pending_writes_buf_len = 0;
+    if (log_compact_claimed) { // after the uploads were answered
+        log_compact_claimed = false;
+        log_compact();
+    }
+}
+
 #define client_write(s) client_write_len(SLEN(s))
 bool client_write_len(const char *s, uint32 l) {
     uint32 pos = 0;
@@ -349,10 +1910,69 @@ bool client_sendfile(int fd, uint32 len) {
     return pos == len;
 }
 
-void client_http_sendfile(int fd) {
+// the ETags are a hash (FNV-1a) of everything the response depends on, so that If-None-Match can be answered before the response is built
+#define ETAG_INITIAL 14695981039346656037ULL
+uint64 etag_add(uint64 hash, uint64 value) {
+    for (uint8 i = 0; i < 8; ++i, value >>= 8)
+        hash = (hash ^ (uint8)value) * 1099511628211ULL;
+    return hash;
+}
+
+void etag_append(char *dest, uint16 *dest_len, uint64 etag) { // with quotes
+    static const char hex[] = "0123456789abcdef";
+    dest[(*dest_len)++] = '"';
+    for (int8 shift = 60; shift >= 0; shift -= 4)
+        dest[(*dest_len)++] = hex[(etag >> shift) & 15];
+    dest[(*dest_len)++] = '"';
+}
+
+bool etag_not_modified(uint64 etag, const char *headers) { // answers with 304 (with the additional headers) if the client already has the response with this ETag (http_buf has to contain the request), otherwise it is remembered in response_etag
+    const char *value = connection_header(http_buf, len, "if-none-match:"), *end = http_buf + len;
+    char tag[18];
+    uint16 tag_len = 0, response_len = 0;
+    response_etag = etag;
+    if (!value)
+        return false;
+    etag_append(tag, &tag_len, etag);
+    for (; value < end && *value != '\r' && *value != '\n'; ++value) // a list of ETags (possibly weak ones, W/"..."), or *
+        if (*value == '*' || (value + tag_len <= end && !memcmp(value, tag, tag_len)))
+            break;
+    if (value >= end || *value == '\r' || *value == '\n')
+        return false;
+    str_append(http_buf, &response_len, "HTTP/1.1 304\r\nConnection: close\r\n");
+    str_append(http_buf, &response_len, headers);
+    str_append(http_buf, &response_len, "ETag: ");
+    etag_append(http_buf, &response_len, etag);
+    str_append(http_buf, &response_len, "\r\n\r\n");
+    client_write_len(http_buf, response_len);
+    return true;
+}
+
+void client_http_sendfile(int fd, int gz_fd, int br_fd) { // gz_fd and br_fd (or -1) are only used if the client accepts them and they aren't older than fd
+    struct stat file, compressed;
     uint16 len = 0;
-    uint32 file_size = fd_size(fd);
-    str_append(http_buf, &len, "HTTP/1.1 200\r\nContent-Type: text/html; charset=UTF-8\r\nConnection: close\r\nContent-Length: ");
+    const char *encoding = NULL;
+    if (fstat(fd, &file))
+        return;
+    if (br_fd != -1 && accepted_encodings & ENCODING_BR && !fstat(br_fd, &compressed) && compressed.st_mtime >= file.st_mtime)
+        fd = br_fd, encoding = "br";
+    else if (gz_fd != -1 && accepted_encodings & ENCODING_GZIP && !fstat(gz_fd, &compressed) && compressed.st_mtime >= file.st_mtime)
+        fd = gz_fd, encoding = "gzip";
+    uint32 file_size = encoding ? compressed.st_size : file.st_size;
+    struct stat *sent = encoding ? &compressed : &file;
+    if (etag_not_modified(etag_add(etag_add(etag_add(ETAG_INITIAL, sent->st_ino), sent->st_mtime), sent->st_size), gz_fd != -1 || br_fd != -1 ? "Vary: Accept-Encoding\r\n" : ""))
+        return;
+    str_append(http_buf, &len, "HTTP/1.1 200\r\nContent-Type: text/html; charset=UTF-8\r\nConnection: close\r\nETag: ");
+    etag_append(http_buf, &len, response_etag);
+    str_append(http_buf, &len, "\r\n");
+    if (gz_fd != -1 || br_fd != -1)
+        str_append(http_buf, &len, "Vary: Accept-Encoding\r\n");
+    if (encoding) {
+        str_append(http_buf, &len, "Content-Encoding: ");
+        str_append(http_buf, &len, encoding);
+        str_append(http_buf, &len, "\r\n");
+    }
+    str_append(http_buf, &len, "Content-Length: ");
     str_append_uint(http_buf, &len, file_size);
     str_append(http_buf, &len, "\r\n\r\n");
     if (!client_write_len(http_buf, len))
@@ -386,6 +2006,35 @@ uint16 get_http_body(void) {
     return 0;
 }
 
+uint8 get_accepted_encodings(void) { // ENCODING_* from the Accept-Encoding header, codings with q=0 aren't accepted
+    const char *value = connection_header(http_buf, len, "accept-encoding:"), *end = http_buf + len;
+    uint8 encodings = 0;
+    while (value && value < end && *value != '\r' && *value != '\n') {
+        while (value < end && (*value == ' ' || *value == ','))
+            ++value;
+        const char *coding = value;
+        bool refused = false;
+        while (value < end && *value != ',' && *value != ';' && *value != ' ' && *value != '\r' && *value != '\n')
+            ++value;
+        uint32 coding_len = value - coding;
+        while (value < end && *value != ',' && *value != '\r' && *value != '\n')
+            if (*value++ == '=' && tolower(value[-2]) == 'q') { // q=0, q=0.0, ...
+                for (refused = true; value < end && (*value == '0' || *value == '.'); ++value);
+                if (value < end && isdigit(*value))
+                    refused = false;
+            }
+        if (refused)
+            continue;
+        if ((coding_len == 4 && !strncasecmp(coding, SLEN("gzip"))) || (coding_len == 6 && !strncasecmp(coding, SLEN("x-gzip"))))
+            encodings |= ENCODING_GZIP;
+        else if (coding_len == 2 && !strncasecmp(coding, SLEN("br")))
+            encodings |= ENCODING_BR;
+        else if (coding_len == 1 && *coding == '*')
+            encodings |= ENCODING_GZIP | ENCODING_BR;
+    }
+    return encodings;
+}
+
 bool is_logged_in(void) {    
     bool searching_colon = false;
     for (uint16 http_buf_pos = strlen("GET / HTTP/1.1\r\n"); http_buf_pos < len; ++http_buf_pos) {
@@ -498,6 +2147,33 @@ void notify(json_object *exec, json_object *name, char *public_token, char *type
     }
 }
 
+bool notification_open_files(notification_monitor_details_t *details) { // read-only, false if there is no data file yet
+    char name[37];
+    if ((details->fd = open(details->token, O_RDONLY)) == -1)
+        return false;
+    details->segments_fd = details->segment_offsets_fd = -1;
+    if (SERVER_COLUMNAR_SEGMENTS) {
+        monitor_file_name(name, details->token, ".seg");
+        details->segments_fd = open(name, O_RDONLY);
+        if (SERVER_COMPRESSED_SEGMENTS && details->segments_fd != -1) {
+            monitor_file_name(name, details->token, ".sgo");
+            if ((details->segment_offsets_fd = open(name, O_RDONLY)) == -1) { // the offsets are needed to read compressed segments
+                close(details->segments_fd);
+                details->segments_fd = -1;
+            }
+        }
+    }
+    return true;
+}
+
+void notification_close_files(notification_monitor_details_t *details) {
+    close(details->fd);
+    if (details->segments_fd != -1)
+        close(details->segments_fd);
+    if (details->segment_offsets_fd != -1)
+        close(details->segment_offsets_fd);
+}
+
 void notifications_proc(void) {
     proc = PROC_NOTIFICATIONS;
     uint32 last_id = 0;
@@ -522,44 +2198,58 @@ start:
             goto start;
         }
         uint32 time_start = time(NULL);
+        if (SERVER_LOG_STRUCTURED) { // the newest data may only be in the log
+            if (log_fd != -1)
+                close(log_fd);
+            if (old_log_fd != -1)
+                close(old_log_fd);
+            log_fd_generation = __atomic_load_n(log_generation, __ATOMIC_ACQUIRE); // before it is opened, so that an older generation is never read from a newer log
+            old_log_fd_generation = log_fd_generation - 1;
+            old_log_fd = open("log.old", O_RDONLY);
+            log_fd = open("log", O_RDONLY);
+        }
         for (uint32 i = 0; i < details_count; ++i) {
             notification_monitor_details_t *details = &notification_details[i];
             if (!json_object_is_type(details->monitoring_settings, json_type_array) || json_object_array_length(details->monitoring_settings) != sizeof(details->notification_sent))
                 continue;
             struct stat data;
-            if (fstat(details->fd, &data) == -1 || data.st_mtim.tv_sec <= 0 || data.st_size <= 0)
+            uint32 data_len;
+            monitor_state_t *state = SERVER_LOG_STRUCTURED || SERVER_HOT_TAIL_HOURS ? monitor_state_find(details->token) : NULL;
+            if (!notification_open_files(details))
                 continue;
+            if (fstat(details->fd, &data) == -1 || !(data_len = data_count(details->fd, details->segments_fd, details->segment_offsets_fd, state)))
+                goto next;
+            if (SERVER_LOG_STRUCTURED && state && state->was_online && state->stats.time > data.st_mtim.tv_sec) // the data file is only modified by the compaction
+                data.st_mtim.tv_sec = state->stats.time;
+            if (data.st_mtim.tv_sec <= 0)
+                goto next;
             uint32 now = time(NULL);
             if (now < data.st_mtim.tv_sec)
-                continue;
+                goto next;
             uint32 last_data_seconds = now - data.st_mtim.tv_sec;
             if (last_data_seconds > DECLARE_DOWN_IF_N_SECONDS_WITHOUT_DATA) { // down
                 json_object *element = json_object_array_get_idx(details->monitoring_settings, 0);
                 if (!element || !json_object_is_type(element, json_type_int))
-                    continue;
+                    goto next;
                 uint64 minutes = json_object_get_uint64(element);
                 if ((last_data_seconds - 60) >= (minutes * 60) && !details->notification_sent[0]) {
                     details->notification_sent[0] = true;
                     notify(exec, details->name, details->public_token, "DOWN", true);
                 }
-                continue;
+                goto next;
             }
             if (details->notification_sent[0]) {
                 details->notification_sent[0] = false;
                 notify(exec, details->name, details->public_token, "DOWN", false);
             }
-            int64 pos = data.st_size - (sample_count * sizeof(stats_t));
-            if (pos < 0)
-                pos = 0;
+            uint32 pos = data_len > sample_count ? data_len - sample_count : 0;
             double double_totals[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
             uint64 uint_totals[4] = { 0, 0, 0, 0 };
             uint32 total_count = 0, count;
-            int32 read_len;
             uint32 last_time = 0;
             uint64 averages[10];
-            while (pos < data.st_size && (read_len = pread(details->fd, http_buf, min(sizeof(stats_t) * (sizeof(http_buf) / sizeof(stats_t)), (uint64)(data.st_size - pos)), pos)) > 0) {
-                count = read_len / sizeof(stats_t);
-                pos += count * sizeof(stats_t);
+            while (pos < data_len && (count = data_read(details->fd, details->segments_fd, details->segment_offsets_fd, state, pos, (stats_t *)http_buf, min(sizeof(http_buf) / sizeof(stats_t), data_len - pos)))) {
+                pos += count;
                 total_count += count;
                 for (uint16 i = 0; i < count; ++i) {
                     stats_t *element = (stats_t *)http_buf + i;
@@ -579,6 +2269,7 @@ start:
                     uint_totals[3] += (element->written_sectors * SECTOR_SIZE) / time_diff;
                 }
             }
+            notification_close_files(details);
             if (!total_count)
                 continue;
             for (uint8 y = 0; y < 6; ++y) {
@@ -609,6 +2300,9 @@ start:
                     notify(exec, details->name, details->public_token, types[y - 1], false);
                 }
             }
+            continue;
+next:
+            notification_close_files(details);
         }
         int status;
         while (waitpid(-1, &status, WNOHANG) > 0); // reap children
@@ -624,32 +2318,168 @@ start:
 
 #define CHECK_IF_PERCENTAGE_TOO_BIG(name) name##_before_decimal > 100 || (name##_before_decimal == 100 && name##_after_decimal) || name##_after_decimal > 99
 
+void reload_if_changed(uint32 *loaded_id) {
+    uint32 id = __atomic_load_n(monitoring_reload, __ATOMIC_RELAXED);
+    if (id == *loaded_id)
+        return;
+    if (pending_writes_count) // they point to the current details
+        pending_writes_flush();
+    while (!parse_data_json())
+        usleep(500);
+    *loaded_id = data_json_generation = id;
+}
+
+void request_use_file(monitor_details_t *monitor) {
+    struct timespec monotonic_time;
+    monitor_use_files(monitor);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic_time);
+    monitor->files_in_use_until = monotonic_time.tv_sec + 11; // the child is terminated after 10 seconds; this also keeps monitor_use_files() from closing them for the other monitors of an /api/history/ request
+}
+
+void request_use_files(void) { // opens the files of the monitor(s) of an /api/data/ or /api/history/ request, a child started with clone() can't open them itself
+    monitor_details_t *monitor;
+    history_request_t request;
+    if (http_buf_compare("GET /api/", "data/") && (uint32)len >= strlen("GET /api/data/") + 32 && (monitor = get_monitor_details_by_public(http_buf + strlen("GET /api/data/"))))
+        request_use_file(monitor);
+    else if (http_buf_compare("GET /api/", "history/") && history_parse(&request, true)) // whether the page may be seen is checked by the child
+        for (uint32 i = 0; i < request.count; ++i)
+            request_use_file(request.monitors[i]);
+}
+
+typedef union { // the control message with the fd of the connection, see pool_pass_on()
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} pool_control_t;
+
+bool pool_pass_on(void) { // passes the current request on to a preforked child, false if too many requests are already waiting
+    pool_control_t control;
+    struct iovec iov = { .iov_base = http_buf, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client, sizeof(int));
+    return sendmsg(pool_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == len;
+}
+
+// a preforked child receives the requests (and the fds of their connections) from its worker through pool_child_fd, a SOCK_SEQPACKET socket shared by all of them, so every request goes to one that is waiting. Unlike the children started with clone(), it has its own fd table, so it opens the files of the monitors itself and reloads data.json itself when it was changed.
+void pool_child(int sock) {
+    struct itimerval timer = { .it_value = { .tv_sec = 10, .tv_usec = 0 }, .it_interval = { .tv_sec = 0, .tv_usec = 0 } }, no_timer = { .it_value = { 0, 0 }, .it_interval = { 0, 0 } };
+    char request[CONNECTION_BUF_SIZE];
+    uint32 loaded_id = data_json_generation;
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGALRM, (sighandler_t)sigalrm_handler);
+    close(sock);
+    close(epoll_fd);
+    close(pool_fd); // otherwise the children wouldn't notice when the worker terminates
+    for (uint32 i = 0; i < connections_used; ++i) // the copies would keep the connections of the worker open
+        if (connections[i].fd != -1)
+            close(connections[i].fd);
+    for (uint32 i = 0; i < streams_count; ++i)
+        close(streams[i].fd);
+    pending_writes_count = 0; // they are written by the worker
+    for (;;) {
+        pool_control_t control;
+        struct iovec iov = { .iov_base = request, .iov_len = sizeof(request) };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        struct cmsghdr *cmsg;
+        int32 request_len = recvmsg(pool_child_fd, &msg, MSG_CMSG_CLOEXEC);
+        if (request_len == -1 && errno == EINTR)
+            continue;
+        if (request_len <= 0) // the worker terminated
+            _exit(0);
+        if (!(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        memcpy(&client, CMSG_DATA(cmsg), sizeof(int));
+        if (close_fds_count)
+            check_close_fds();
+        reload_if_changed(&loaded_id);
+        if (SERVER_LOG_STRUCTURED)
+            log_reopen_if_rotated();
+        memcpy(http_buf, request, request_len); // only now as reloading data.json may use http_buf
+        len = request_len;
+        request_use_files();
+        setitimer(ITIMER_REAL, &timer, NULL); // like the other children, but the child is restarted then
+        process_request();
+        setitimer(ITIMER_REAL, &no_timer, NULL);
+        close(client);
+    }
+}
+
+void pool_start(int sock) { // (re)starts the preforked children that aren't running
+    sigset_t sigchld, previous;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &previous); // so that sigchld_handler() sees the pid of a child that terminates immediately
+    __atomic_store_n(&pool_restart, false, __ATOMIC_RELAXED);
+    for (uint32 i = 0; i < pool_size; ++i) {
+        if (pool_pids[i])
+            continue;
+        int pid = fork();
+        if (!pid) {
+            sigprocmask(SIG_SETMASK, &previous, NULL);
+            pool_child(sock);
+        }
+        if (pid > 0)
+            pool_pids[i] = pid;
+        else // tried again in the next iteration of the main loop
+            __atomic_store_n(&pool_restart, true, __ATOMIC_RELAXED);
+    }
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+}
+
 /*
-monitoring_server PATH MAX_CHILDREN [LISTEN_PORT]
+monitoring_server PATH MAX_CHILDREN [LISTEN_PORT] [WORKERS]
 */
 int main(int argc, char **argv) {
     COMPILE_TIME_CHECKS
-    int32 max_children;
+    int32 max_children, workers = 1;
     uint16 port = 9999, expected_len, body;
-    if ((argc != 3 && argc != 4) || chdir(argv[1]) || !(max_children = (int32)strtoul(argv[2], NULL, 10)) || (argc == 4 && !(port = (uint16)strtoul(argv[3], NULL, 10)))) {
-        write(2, SLEN("Missing/invalid argument(s)!\nmonitoring_server PATH MAX_CHILDREN [LISTEN_PORT]\nFor details, look into the README.\n"));
+    if (argc < 3 || argc > 5 || chdir(argv[1]) || !(max_children = (int32)strtoul(argv[2], NULL, 10)) || (argc >= 4 && !(port = (uint16)strtoul(argv[3], NULL, 10))) || (argc == 5 && (workers = (int32)strtoul(argv[4], NULL, 10)) < 1)) {
+        write(2, SLEN("Missing/invalid argument(s)!\nmonitoring_server PATH MAX_CHILDREN [LISTEN_PORT] [WORKERS]\nFor details, look into the README.\n"));
         return 99;
     }
     signal(SIGPIPE, SIG_IGN);
-    monitoring_reload = mmap(NULL, CACHELINE + CACHELINE + CACHELINE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (monitoring_reload == MAP_FAILED)
+    monitoring_reload = mmap(NULL, 9 * CACHELINE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    monitor_states = mmap(NULL, SERVER_MAX_MONITORS * (sizeof(monitor_state_t) + 2 * sizeof(uint32)), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (SERVER_HOT_TAIL_HOURS)
+        hot_tails = mmap(NULL, (uint64)SERVER_MAX_MONITORS * HOT_TAIL_RECORDS * sizeof(stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (monitoring_reload == MAP_FAILED || monitor_states == MAP_FAILED || hot_tails == MAP_FAILED)
         return 2;
+    monitor_states_index = (uint32 *)(monitor_states + SERVER_MAX_MONITORS);
+    admin_proc = (void *)((uint8 *)monitoring_reload + CACHELINE);
+    monitor_states_lock = (void *)((uint8 *)monitoring_reload + 2 * CACHELINE);
+    monitor_states_used = (void *)((uint8 *)monitoring_reload + 3 * CACHELINE);
+    log_lock = (void *)((uint8 *)monitoring_reload + 4 * CACHELINE);
+    log_generation = (void *)((uint8 *)monitoring_reload + 5 * CACHELINE);
+    log_compact_at = (void *)((uint8 *)monitoring_reload + 6 * CACHELINE);
+    log_old_pending = (void *)((uint8 *)monitoring_reload + 7 * CACHELINE);
+    log_compacting = (void *)((uint8 *)monitoring_reload + 8 * CACHELINE);
     __atomic_store_n(monitoring_reload, (uint32)0, __ATOMIC_RELAXED);
+    __atomic_store_n(admin_proc, false, __ATOMIC_RELAXED);
+    segments_prepare();
+    log_prepare();
+    if (SERVER_LOG_STRUCTURED) {
+        struct timespec monotonic_time;
+        clock_gettime(CLOCK_MONOTONIC, &monotonic_time);
+        __atomic_store_n(log_compact_at, (uint64)monotonic_time.tv_sec + SERVER_LOG_COMPACT_SECONDS, __ATOMIC_RELAXED);
+        log_fd = open_with_retries("log", O_RDWR | O_CREAT | O_APPEND);
+    }
+    server_started = time(NULL); // before the workers are started so that their ETags are the same
     int pid = fork();
     if (pid == -1)
         return 3;
     if (!pid)
         notifications_proc();
     proc = PROC_WEB;
-    data_json_changed = (void *)((uint8 *)monitoring_reload + CACHELINE);
-    admin_proc = (void *)((uint8 *)monitoring_reload + CACHELINE + CACHELINE);
-    __atomic_store_n(data_json_changed, false, __ATOMIC_RELAXED);
-    __atomic_store_n(admin_proc, false, __ATOMIC_RELAXED);
+    for (int32 i = 1; i < workers; ++i) // every worker has its own listening socket (SO_REUSEPORT), the kernel distributes the connections between them
+        if ((pid = fork()) == -1)
+            return 3;
+        else if (!pid)
+            break;
+    max_children = max(max_children / workers, 1);
+    uint32 loaded_id = 0;
     struct sigaction sa;
     sa.sa_handler = (sighandler_t)sigchld_handler;
     sigemptyset(&sa.sa_mask);
@@ -657,14 +2487,15 @@ int main(int argc, char **argv) {
     sigaction(SIGCHLD, &sa, NULL);
     __atomic_store_n(&children, 0, __ATOMIC_RELAXED);
     int sock, opt = 1;
-    struct sockaddr client_addr;
     struct sockaddr_in listen_to;
     net_header_t *ptr_header;
     stats_t *ptr_stats;
-    socklen_t addrlen = sizeof(client_addr);
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
         return 4;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (workers > 1 && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+        return 4;
+    setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)); // only accept connections once data arrived
     memset(&listen_to, 0, sizeof(listen_to));
     listen_to.sin_family = AF_INET;
 #ifdef LISTEN_ALL
@@ -677,62 +2508,74 @@ int main(int argc, char **argv) {
         return 5;
     if (listen(sock, SERVER_LISTEN_BACKLOG) < 0)
         return 6;
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.u32 = EPOLL_LISTEN_ID };
+    if ((epoll_fd = epoll_create1(0)) < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &listen_event) ||
+        !(connections = malloc(SERVER_MAX_CONNECTIONS * sizeof(connection_t))) ||
+        !(connection_bufs = malloc(SERVER_MAX_CONNECTIONS * CONNECTION_BUF_SIZE)) || // only touched pages are actually allocated
+        !(connections_free = malloc(SERVER_MAX_CONNECTIONS * sizeof(uint32))))
+        return 7;
+    if (!(pending_writes = malloc(SERVER_GROUP_COMMIT_MAX_UPLOADS * sizeof(pending_write_t))) || !(pending_writes_buf = malloc(SERVER_GROUP_COMMIT_BUF_SIZE)) ||
+        (SERVER_MAX_STREAMS && !(streams = malloc(SERVER_MAX_STREAMS * sizeof(stream_t)))))
+        return 7;
+    for (uint32 i = 0; i < SERVER_MAX_CONNECTIONS; ++i) {
+        connections[i].fd = -1;
+        connections_free[connections_free_count++] = SERVER_MAX_CONNECTIONS - 1 - i; // so that low ids are used first
+    }
     while (!parse_data_json())
         usleep(500);
     status_page_fd = open_with_retries("status.html", O_RDONLY);
     monitor_page_fd = open_with_retries("monitor.html", O_RDONLY);
     admin_page_fd = open_with_retries("admin.html", O_RDONLY);
     favicon_ico_fd = open("favicon.ico", O_RDONLY);
+    status_page_gz_fd = open("status.html.gz", O_RDONLY);
+    status_page_br_fd = open("status.html.br", O_RDONLY);
+    monitor_page_gz_fd = open("monitor.html.gz", O_RDONLY);
+    monitor_page_br_fd = open("monitor.html.br", O_RDONLY);
+    admin_page_gz_fd = open("admin.html.gz", O_RDONLY);
+    admin_page_br_fd = open("admin.html.br", O_RDONLY);
     json_c_set_serialization_double_format("%.2f", JSON_C_OPTION_GLOBAL);
+    if (SERVER_PREFORKED_CHILDREN) {
+        int pool_fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pool_fds) || !(pool_pids = calloc(SERVER_PREFORKED_CHILDREN, sizeof(int))))
+            return 8;
+        pool_fd = pool_fds[0];
+        pool_child_fd = pool_fds[1];
+        pool_size = SERVER_PREFORKED_CHILDREN;
+        pool_start(sock);
+    }
     for (;;) {
+        if (SERVER_PREFORKED_CHILDREN && __atomic_load_n(&pool_restart, __ATOMIC_RELAXED))
+            pool_start(sock);
         if (close_fds_count)
             check_close_fds();
-        if (__atomic_load_n(data_json_changed, __ATOMIC_RELAXED)) {
-            while (!parse_data_json())
-                usleep(500);
-            __atomic_store_n(data_json_changed, false, __ATOMIC_RELAXED);
-            uint32 id = time(NULL);
-            if (__atomic_load_n(monitoring_reload, __ATOMIC_RELAXED) == id)
-                ++id;
-            __atomic_store_n(monitoring_reload, id, __ATOMIC_RELAXED);
-        }
-        if ((client = syscall(__NR_accept4, sock, &client_addr, &addrlen, SOCK_NONBLOCK)) < 0)
+        reload_if_changed(&loaded_id);
+        if (SERVER_LOG_STRUCTURED) // before children are started, they can only read the blocks in the log they got
+            log_reopen_if_rotated();
+        if (pending_writes_count && monotonic_ms() >= pending_writes_deadline)
+            pending_writes_flush();
+        if (streams_count && monotonic_ms() >= streams_check_at)
+            streams_check();
+        if (!next_request(sock))
             continue;
-        unsigned int timeout = 50; // 50 ms, should be more than enough as the reverse proxy should be on the same machine
-        struct timeval timeout_struct = { .tv_sec = 0, .tv_usec = 50000 };
-        if (setsockopt(client, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) ||
-            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout_struct, sizeof(timeout_struct)) ||
-            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout_struct, sizeof(timeout_struct)) ||
-            !sock_ready(client, true, 1) || (len = read(client, http_buf, sizeof(http_buf) - 1)) < (int32)strlen("GET / HTTP/1.1\r\nHost:\r\n\r\n"))
+        if (len < (int32)strlen("GET / HTTP/1.1\r\nHost:\r\n\r\n"))
             goto cont;
         bool admin = false;
         if (http_buf[1] == 'E') { // GET
             if (http_buf_compare("GET /", "admin") && http_buf[strlen("GET /admin ") - 1] != ' ' && http_buf[strlen("GET /admin/ ") - 1] != ' ')
                 goto admin;
+            if (http_buf_compare("GET /api/", "stream/page/")) {
+                request_done(stream_open() ? REQUEST_PASSED_ON : REQUEST_CLOSE);
+                continue;
+            }
+            if (SERVER_PREFORKED_CHILDREN && pool_pass_on())
+                goto cont; // the child has its own copy of the fd
+            request_use_files();
             goto fork;
         }
         if (http_buf[1] != 'O') // POST
             goto cont;
         if (http_buf_compare("POST /", "submit")) { // POST /submit: new data
-            body = get_http_body();
-            if (!body) { // caddy seems to send the request in pieces, not optimal as this will block the main process longer, but I don't see a better way with the current architecture
-                if (sock_ready(client, true, 1)) {
-                    int tmp = read(client, http_buf + len, sizeof(http_buf) - len);
-                    if (tmp <= 0)
-                        goto cont;
-                    len += tmp;
-                    body = get_http_body();
-                    if (!body || len == body)
-                        goto cont;
-                } else
-                    goto cont;
-            }
-            if (len == body && sock_ready(client, true, 1)) {
-                len = read(client, http_buf, sizeof(http_buf));
-                if (len == -1)
-                    goto cont;
-                body = 0;
-            }
+            body = get_http_body(); // the body was already received completely, see connection_read()
             if ((uint32)len < body + sizeof(net_header_t) + sizeof(details_t))
                 goto cont;
             ptr_header = (net_header_t *)(http_buf + body);
@@ -749,12 +2592,17 @@ int main(int argc, char **argv) {
                 expected_len += sizeof(stats_t) * ptr_header->stats_count;
                 if (expected_len + body != (uint32)len)
                     goto cont;
-                uint32 last_time = monitor->was_online ? monitor->stats.time : 0, error_if_bigger_than = time(NULL) + 100;
+                monitor_state_t *state = monitor->state;
+                if (!ptr_header->stats_count)
+                    goto success;
+                uint32 error_if_bigger_than = time(NULL) + 100;
+                bool valid = true;
                 ptr_stats = (stats_t *)(http_buf + body + sizeof(net_header_t));
                 if (ptr_header->includes_details)
                     ptr_stats = (stats_t *)((uint8 *)ptr_stats + sizeof(details_t));
-                for (uint8 i = 0; i < ptr_header->stats_count; ++i) {
-                    if (ptr_stats[i].time <= last_time // Likely resubmission of data because the success response wasn't received => don't save but respond with a success message (problematic in case of time adjustment but there's no easy correct way to handle this, and it would likely mean that data would have to be removed from the file (how much?), so this is the most reasonable I think.)
+                spin_lock(&state->lock); // so that an upload that is just being sent again to another worker is noticed
+                for (uint8 i = 0; valid && i < ptr_header->stats_count; ++i) {
+                    if (ptr_stats[i].time <= state->newest_time // Likely resubmission of data because the success response wasn't received => don't save but respond with a success message (problematic in case of time adjustment but there's no easy correct way to handle this, and it would likely mean that data would have to be removed from the file (how much?), so this is the most reasonable I think.)
                         || ptr_stats[i].time > error_if_bigger_than // if there's a significant time difference, don't save the data
                         || CHECK_IF_PERCENTAGE_TOO_BIG(ptr_stats[i].cpu_usage)
                         || CHECK_IF_PERCENTAGE_TOO_BIG(ptr_stats[i].cpu_iowait)
@@ -763,41 +2611,34 @@ int main(int argc, char **argv) {
                         || CHECK_IF_PERCENTAGE_TOO_BIG(ptr_stats[i].swap_usage)
                         || CHECK_IF_PERCENTAGE_TOO_BIG(ptr_stats[i].disk_usage)
                     )
-                        goto success;
-                }
-                if ((len = write(monitor->fd, ptr_stats, sizeof(stats_t) * ptr_header->stats_count)) != -1) {
-                    if (len < (int32)(sizeof(stats_t) * ptr_header->stats_count)) {
-                        usleep(1000);
-                        int32 tmp = write(monitor->fd, ((uint8 *)ptr_stats) + len, (sizeof(stats_t) * ptr_header->stats_count) - len);
-                        if (tmp > 0)
-                            len += tmp;
-                    }
-                    if ((uint32)len != (sizeof(stats_t) * ptr_header->stats_count)) {
-                        uint32 file_len;
-                        if (len && (file_len = fd_size(monitor->fd)) >= (uint32)len)
-                            ftruncate(monitor->fd, file_len - len); // try to remove the part that was already written
-                        goto cont;
-                    }
-                } else
-                    goto cont;
-                for (uint8 i = 0; i < ptr_header->stats_count; ++i) { // not done in the above loop because only now all data is validated and saved
-                    monitor->rx_total += ptr_stats[i].rx_bytes;
-                    monitor->tx_total += ptr_stats[i].tx_bytes;
-                    monitor->sectors_read_total += ptr_stats[i].read_sectors;
-                    monitor->sectors_written_total += ptr_stats[i].written_sectors;
-                }
-                if (ptr_header->includes_details) {
-                    monitor->was_online = true;
-                    memcpy(&monitor->details, http_buf + body + sizeof(net_header_t), sizeof(details_t));
-                    memcpy(&monitor->stats, ptr_stats + ptr_header->stats_count - 1, sizeof(stats_t));
-                    if (ptr_stats[ptr_header->stats_count - 1].time - last_time > (uint32)min(CONFIG_MEASURE_EVERY_N_SECONDS * 1.2, CONFIG_MEASURE_EVERY_N_SECONDS + 1))
-                        monitor->time_diff = (CONFIG_MEASURE_EVERY_N_SECONDS + 1);
-                    else
-                        monitor->time_diff = ptr_stats[ptr_header->stats_count - 1].time - last_time;
+                        valid = false;
                 }
+                if (valid)
+                    state->newest_time = ptr_stats[ptr_header->stats_count - 1].time;
+                spin_unlock(&state->lock);
+                if (!valid)
+                    goto success;
+                // the data is written by pending_writes_flush(), which also answers the request
+                pending_write_t *pending = &pending_writes[pending_writes_count++];
+                pending->conn = current_connection;
+                pending->monitor = monitor;
+                pending->offset = pending_writes_buf_len;
+                pending->stats_count = ptr_header->stats_count;
+                pending->includes_details = ptr_header->includes_details;
+                pending->done = false;
+                if (pending->includes_details)
+                    memcpy(&pending->details, http_buf + body + sizeof(net_header_t), sizeof(details_t));
+                memcpy(pending_writes_buf + pending_writes_buf_len, ptr_stats, sizeof(stats_t) * ptr_header->stats_count);
+                pending_writes_buf_len += sizeof(stats_t) * ptr_header->stats_count;
+                current_connection->timeout_at = (uint64)-1; // mustn't be closed while waiting
+                if (pending_writes_count == 1)
+                    pending_writes_deadline = monotonic_ms() + SERVER_GROUP_COMMIT_MS;
+                if (pending_writes_count == SERVER_GROUP_COMMIT_MAX_UPLOADS || pending_writes_buf_len > SERVER_GROUP_COMMIT_BUF_SIZE - 255 * sizeof(stats_t)) // there has to be space for the largest possible upload
+                    pending_writes_flush();
+                continue;
 success:
-                if (sock_ready(client, false, 1))
-                    write(client, SLEN("HTTP/1.1 200\r\nContent-Length: 1\r\nConnection: close\r\n\r\n1"));
+                submit_done(true);
+                continue;
             }
             goto cont;
         }
@@ -809,14 +2650,7 @@ admin:
                 admin = ADMIN_STATE_LOGIN;
                 goto fork;
             }
-            if (__atomic_load_n(data_json_changed, __ATOMIC_RELAXED)) { // if the admin process was still running when it was last checked
-                while (!parse_data_json());
-                __atomic_store_n(data_json_changed, false, __ATOMIC_RELAXED);
-                uint32 id = time(NULL);
-                if (__atomic_load_n(monitoring_reload, __ATOMIC_RELAXED) == id)
-                    ++id;
-                __atomic_store_n(monitoring_reload, id, __ATOMIC_RELAXED);
-            }
+            reload_if_changed(&loaded_id); // if the admin process was still running when it was last checked
             if (!is_logged_in() || __atomic_load_n(admin_proc, __ATOMIC_RELAXED))
                 goto cont;
             __atomic_store_n(admin_proc, true, __ATOMIC_RELAXED); // no CAS needed because if no admin process is running, this variable won't be modified from anywhere else
@@ -828,6 +2662,7 @@ fork:
             goto cont;
         if ((pid = syscall(__NR_clone, CLONE_FILES | SIGCHLD, 0, 0, 0, 0)) > 0) {
             __atomic_add_fetch(&children, 1, __ATOMIC_RELAXED);
+            request_done(REQUEST_PASSED_ON);
             continue;
         } else {
             if (!pid) {
@@ -845,6 +2680,6 @@ fork:
                 __atomic_store_n(admin_proc, false, __ATOMIC_RELAXED);
         }
 cont:
-        close(client);
+        request_done(REQUEST_CLOSE);
     }
 }
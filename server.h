@@ -27,6 +27,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#ifndef FALLOC_FL_PUNCH_HOLE // fcntl.h only defines it with _GNU_SOURCE
+#include <linux/falloc.h>
+#endif
 #include <signal.h>
 #include <time.h>
 #include <ctype.h>
@@ -40,6 +43,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <sys/time.h>
 #include <sys/sendfile.h>
 #include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <stdio.h>
 #include "str.c"
 #include "json-c/json.h"
 
@@ -54,37 +63,199 @@ typedef void (*sighandler_t)(int);
 #define CACHELINE 64
 #define http_buf_compare(s1, s) (((uint16)len >= strlen(s1) + strlen(s)) && !memcmp(http_buf + strlen(s1), SLEN(s)))
 #define SECTOR_SIZE 512
+#define CONNECTION_BUF_SIZE (HTTP_BUF_SIZE) // the request is copied to http_buf
+#define SUBMIT_MAX_SIZE 8192 // uploads (including the headers) that are larger are rejected
+_Static_assert(sizeof(net_header_t) + sizeof(details_t) + CONFIG_UPLOAD_MAX_N_STATS_AT_ONCE * sizeof(stats_t) + 4096 <= SUBMIT_MAX_SIZE, "SUBMIT_MAX_SIZE is too small for the largest upload with 4 KiB of headers");
+_Static_assert(SUBMIT_MAX_SIZE < CONNECTION_BUF_SIZE && CONNECTION_BUF_SIZE <= 65535, "the lengths of the requests are uint16");
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_LISTEN_ID ((uint32)-1)
+#define STREAM_CHECK_MS 500 // how often the streams are checked for changed monitors
+#define STREAM_HEARTBEAT_MS 15000 // a comment is sent to streams without events after this time, so that closed connections are noticed
+#define STREAM_BUFFER_SIZE 262144 // for what the socket of a stream didn't take yet, a stream whose client doesn't keep up is closed when it is full
+#define ROLLUP_TIERS 3
+#define ROLLUP_CENTROIDS 5 // of the t-digest of every value in a rollup interval, so with the default CONFIG_MEASURE_EVERY_N_SECONDS the ones of the 5-minute intervals are exact
+#define ROLLUP_MAGIC 0x4c52544c // "LTRL", see rollup_header_t
+#define TIME_INDEX_BLOCK 128 // the time index ({TOKEN}.idx) contains an entry for every TIME_INDEX_BLOCKth stats_t (so one per 5 KB of data)
+#define SEGMENT_RECORDS TIME_INDEX_BLOCK // stats_t per columnar segment, has to be the same so that a block of the time index is always in one segment
+#define SEGMENT_COMPRESSED_MAX_SIZE (SEGMENT_RECORDS * (5 + 6 * 3 + 4 * 10)) // every value is stored as a varint, which needs at most 5 bytes for the times, 3 for the percentages and 10 for the counters
+#define MONITOR_FILES (4 + ROLLUP_TIERS) // data, segments, segment offsets, time index and rollups
+#define ZIGZAG(value) (((uint64)(value) << 1) ^ (uint64)((int64)(value) >> 63)) // so that small negative values are small varints as well
+#define UNZIGZAG(value) ((int64)((value) >> 1) ^ -(int64)((value) & 1))
 
 _Atomic int32 children;
+_Atomic bool pool_restart; // a preforked child (SERVER_PREFORKED_CHILDREN) terminated or couldn't be started
+
+const uint32 rollup_tier_seconds[ROLLUP_TIERS] = { 5 * 60, 60 * 60, 24 * 60 * 60 };
+const char *rollup_tier_suffixes[ROLLUP_TIERS] = { ".5m", ".1h", ".1d" };
+
+typedef struct { // SEGMENT_RECORDS stats_t stored column by column (no padding is necessary), the segment files ({TOKEN}.seg) are arrays of these, see SERVER_COLUMNAR_SEGMENTS
+    uint32 time[SEGMENT_RECORDS];
+    uint16 percent[6][SEGMENT_RECORDS]; // cpu usage, iowait, steal, ram usage, swap usage, disk usage; in hundredths
+    uint64 counter[4][SEGMENT_RECORDS]; // rx bytes, tx bytes, read sectors, written sectors
+} segment_t;
+
+typedef struct PACKED { // the time index is an array of these
+    uint32 time; // of the first stats_t of the block
+    uint64 totals[4]; // rx bytes, tx bytes, read sectors, written sectors of all stats_t before the block, so that load_totals() only has to read the last block
+} time_index_entry_t;
+
+typedef struct PACKED { // count values with this mean, a t-digest is an array of these
+    uint16 mean; // the percentages in hundredths, the rates see centroid_rate_encode()
+    uint16 count;
+} centroid_t;
+
+typedef struct PACKED { // aggregated data of one interval, the rollup files ({TOKEN}.5m, .1h and .1d) are a rollup_header_t followed by an array of these
+    uint32 time; // start of the interval
+    uint32 count; // number of stats_t in this interval
+    uint64 time_sum;
+    uint32 percent_sum[6]; // cpu usage, iowait, steal, ram usage, swap usage, disk usage; in hundredths
+    uint16 percent_min[6];
+    uint16 percent_max[6];
+    uint64 bytes_sum[4]; // rx, tx, read, written
+    uint64 rate_sum[4]; // per second, like api_data() calculates them
+    uint64 rate_min[4];
+    uint64 rate_max[4];
+    centroid_t centroids[10][ROLLUP_CENTROIDS]; // t-digests of the percentages (in hundredths) and the rates, for the percentiles; sorted by mean, the unused centroids have a count of 0
+} rollup_t;
+
+typedef struct PACKED { // at the start of every rollup file, so that files of another format (e.g. of an older version) are noticed and rebuilt by load_totals()
+    uint32 magic; // ROLLUP_MAGIC
+    uint32 rollup_size; // sizeof(rollup_t)
+} rollup_header_t;
+
+#define ROLLUP_OFFSET(index) (sizeof(rollup_header_t) + (index) * sizeof(rollup_t)) // in the rollup file
 
-_Atomic bool *data_json_changed;
-_Atomic uint32 *monitoring_reload;
+_Atomic uint32 *monitoring_reload; // incremented whenever data.json was changed
 _Atomic bool *admin_proc;
+_Atomic bool *monitor_states_lock;
+_Atomic uint32 *monitor_states_used;
+_Atomic bool *log_lock; // held while the log is appended to or replaced (SERVER_LOG_STRUCTURED)
+_Atomic uint32 *log_generation; // incremented whenever the log was replaced by a new one
+_Atomic uint64 *log_compact_at; // CLOCK_MONOTONIC, in seconds
+_Atomic bool *log_old_pending; // the previous log (log.old) wasn't completely moved to the data files yet, so the log can't be replaced again
+_Atomic bool *log_compacting; // a worker is moving log.old to the data files
+
+typedef struct PACKED { // the log consists of these, each followed by count stats_t
+    char token[32];
+    uint32 count;
+    uint32 first_time; // of the first stats_t
+    uint32 crc; // CRC32C of the members above and the stats_t, so that log_prepare() can recognize incomplete or corrupted frames
+} log_frame_t;
 
 typedef struct {
-    char token[33];
-    char public_token[33];
-    int fd;
+    uint32 offset; // of the first stats_t in the log
+    uint32 count;
+} log_block_t;
+
+#define LOG_MAX_SIZE (1U << 30) // the offsets in the log are uint32, so it is compacted before it gets larger
+
+typedef struct { // in shared memory so that all worker processes (and their children) see the same data
+    char token[32];
+    _Atomic bool lock; // held while data is appended, so that the same monitor can't be written to by two workers at once
+    bool deleted;
     bool was_online;
     uint8 time_diff;
+    _Atomic bool loading; // while a worker runs load_totals() for it (without monitor_states_lock), the others wait until it's done
     details_t details;
     stats_t stats;
     uint64 rx_total;
     uint64 tx_total;
     uint64 sectors_read_total;
     uint64 sectors_written_total;
+    uint32 records; // count of stats_t of the monitor (in the segments, the data file and the log)
+    uint32 rollup_last_time; // time of the last stats_t added to the rollups
+    uint32 newest_time; // of the newest stats_t that was written or is waiting to be written (by any worker), uploads that aren't newer are resubmissions
+    uint32 written_time; // of the newest stats_t that was written
+    rollup_t rollups[ROLLUP_TIERS]; // the current intervals, they are appended to the rollup files when the next one starts
+    uint32 log_generation; // of the log the blocks are in
+    uint32 log_records; // count of stats_t in the blocks, they come after the ones in the data file and the old blocks
+    uint8 log_blocks_count;
+    log_block_t log_blocks[SERVER_LOG_MAX_PENDING]; // uploads that are in the log but not yet in the data file (SERVER_LOG_STRUCTURED)
+    uint32 old_log_generation; // of the log the old blocks are in (log.old)
+    uint32 old_log_records;
+    uint8 old_log_blocks_count;
+    log_block_t old_log_blocks[SERVER_LOG_MAX_PENDING]; // the blocks when the log was replaced, until log_compact() moved them to the data file
+    _Atomic uint32 log_seq; // odd while the blocks are changed (or log_compact() appends them to the data file), readers wait until it's even again
+    _Atomic uint32 hot_tail_seq; // odd while records or the hot tail are changed, readers that see it change use the files instead
+    uint32 hot_tail_count; // the hot tail contains the last hot_tail_count of the records stats_t
+    uint32 version; // incremented after every upload (after the changes), for the ETags of the API
+} monitor_state_t;
+
+#define HOT_TAIL_RECORDS max(SERVER_HOT_TAIL_HOURS * 3600 / CONFIG_MEASURE_EVERY_N_SECONDS, 1) // never 0, so that the code compiles even if it is disabled
+
+typedef struct { // a read-only mapping of a part of a data file, see data_map_read()
+    const uint8 *map; // NULL if nothing is mapped
+    uint32 len;
+    uint32 first; // position of the first stats_t that can be accessed through it
+    uint32 count;
+    const stats_t *stats; // the one at first
+} data_map_t;
+
+#define DATA_MAP_ALIGN 65536 // mappings start at a multiple of this, which is a multiple of the page size
+#define DATA_MAP_MAX_SIZE 1048576 // at most this much of a data file is mapped (and read ahead) at once
+
+typedef struct {
+    char token[33];
+    char public_token[33];
+    int fd;
+    int segments_fd; // -1 if SERVER_COLUMNAR_SEGMENTS is disabled
+    int segment_offsets_fd; // -1 unless SERVER_COMPRESSED_SEGMENTS is enabled
+    int time_index_fd;
+    int rollup_fds[ROLLUP_TIERS];
     bool public;
+    bool files_open; // the fds above are only valid if this is true, see monitor_use_files()
+    bool files_used; // for the clock algorithm of monitor_use_files()
+    time_t files_in_use_until; // children started before (monotonic time) may still use the fds, so they can't be closed yet
+    monitor_state_t *state;
+    uint64 stream_tag; // see api_page_add_element(), calculated once per streams_check()
+    uint32 stream_tag_check; // the streams_check_id of stream_tag
 } monitor_details_t;
 
 typedef struct {
     char token[33];
     char public_token[33];
-    int fd;
+    int fd; // the fds are only open while the monitor is checked
+    int segments_fd;
+    int segment_offsets_fd;
     bool notification_sent[11]; // offline, cpu_usage, cpu_iowait, cpu_steal, ram_usage, swap_usage, disk_usage, net_rx_bps, net_tx_bps, disk_read_bps, disk_write_tx_bps
     json_object *name;
     json_object *monitoring_settings;
 } notification_monitor_details_t;
 
+typedef struct {
+    int fd; // -1 if the slot is unused
+    uint16 len;
+    uint16 body; // 0 as long as the headers weren't received completely
+    uint32 content_length; // only used for POST /submit, for everything else the request is handed over as soon as the headers are complete
+    bool keep_alive;
+    bool idle; // kept alive after a request and nothing was received since then
+    uint64 timeout_at; // CLOCK_MONOTONIC, in ms
+} connection_t;
+
+typedef struct { // a validated upload that is waiting to be written, the connection is only answered afterwards
+    connection_t *conn;
+    monitor_details_t *monitor;
+    uint32 offset; // of the stats in pending_writes_buf
+    uint32 log_offset; // of the block of the monitor in the log (0 if its uploads are written to the data file directly), only set for the first pending write of every monitor
+    uint8 stats_count;
+    bool includes_details;
+    bool done;
+    details_t details;
+} pending_write_t;
+
+typedef struct { // a live update stream, see /api/stream/page/{PAGE}
+    int fd;
+    bool admin;
+    uint8 state; // of the page, see get_page()
+    char *page; // the name
+    struct json_object *page_monitors; // of the current data.json
+    uint32 generation; // the data_json_generation the page was sent for
+    uint64 *sent; // the tags of the monitors of the page (in the same order) when they were last sent, see api_page_add_element()
+    uint64 heartbeat_at; // CLOCK_MONOTONIC, in ms
+    char *buf; // STREAM_BUFFER_SIZE, allocated when the socket doesn't take everything
+    uint32 buf_len;
+} stream_t;
+
 typedef struct {
     int fd; // close if close_at >= current, and fd != -1
     time_t close_at;
@@ -95,6 +266,15 @@ char http_buf[HTTP_BUF_SIZE];
 monitor_details_t *details = NULL;
 notification_monitor_details_t *notification_details = NULL;
 close_fds_t *close_fds = NULL;
+monitor_state_t *monitor_states = NULL;
+stats_t *hot_tails = NULL; // HOT_TAIL_RECORDS per monitor state (a ring, stats_t number pos is at pos % HOT_TAIL_RECORDS), in shared memory too
+uint32 *monitor_states_index = NULL; // SERVER_MAX_MONITORS * 2 slots, 0 if empty, otherwise the position in monitor_states + 1
+connection_t *connections = NULL, *current_connection;
+char (*connection_bufs)[CONNECTION_BUF_SIZE] = NULL;
+uint32 *connections_free = NULL;
+stream_t *streams = NULL;
+pending_write_t *pending_writes = NULL;
+uint8 *pending_writes_buf = NULL;
 struct json_object *data_json = NULL, *monitors, *status_pages;
 enum {
     SHOULD_HIDE_TOTAL_IO = 0,
@@ -117,10 +297,24 @@ enum {
 };
 bool should_hide[17];
 const char *admin_hash;
-int client, status_page_fd, monitor_page_fd, admin_page_fd, favicon_ico_fd;
+int client, epoll_fd, status_page_fd, monitor_page_fd, admin_page_fd, favicon_ico_fd, log_fd = -1, old_log_fd = -1;
+int status_page_gz_fd, status_page_br_fd, monitor_page_gz_fd, monitor_page_br_fd, admin_page_gz_fd, admin_page_br_fd; // the precompressed versions ({FILE}.gz, {FILE}.br), -1 if they don't exist
+int pool_fd, pool_child_fd, *pool_pids = NULL; // the requests are passed to the preforked children through pool_fd, pool_child_fd is their end; the pid of a child is 0 if it has to be (re)started
+uint32 pool_size = 0; // SERVER_PREFORKED_CHILDREN once pool_pids was allocated
 int32 len;
+#define ENCODING_GZIP 1
+#define ENCODING_BR 2
+uint8 accepted_encodings; // of the current request
 
-uint32 details_count = 0, close_fds_count = 0;
+uint32 details_count = 0, open_monitors = 0, files_clock = 0, token_index_mask = 0, close_fds_count = 0, connections_free_count = 0, connections_used = 0, pending_writes_count = 0, pending_writes_buf_len = 0;
+uint64 pending_writes_deadline; // CLOCK_MONOTONIC, in ms
+uint32 streams_count = 0;
+uint64 streams_check_at = 0; // CLOCK_MONOTONIC, in ms
+uint32 streams_check_id = 1; // incremented by every streams_check()
+uint32 log_fd_generation = 0, old_log_fd_generation = 0; // the generation of the log log_fd (old_log_fd) refers to
+bool log_compact_claimed = false; // this worker set log_compacting, log_compact() is called once log_lock was released
+uint32 server_started, data_json_generation = 0; // for the ETags, the value of monitoring_reload the current data.json was loaded for
+uint64 response_etag; // set by etag_not_modified()
 
 enum {
     PROC_WEB,
@@ -128,5 +322,6 @@ enum {
 } proc;
 
 #define TO_DOUBLE_FROM_TWO_UINTS(data) ((double)data##_before_decimal + ((double)data##_after_decimal / 100.0))
+#define TO_HUNDREDTHS(data) ((uint16)data##_before_decimal * 100 + data##_after_decimal)
 
 #endif
\ No newline at end of file
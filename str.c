@@ -16,6 +16,17 @@ uint8 itoa(uint32 n, char *s) {
     return i;
 }
 
+uint8 itoa64(uint64 n, char *s) {
+    uint8 i = 0, y = 0, z;
+    do
+        s[i] = n % 10 + '0', ++i;
+    while ((n /= 10) > 0);
+    z = i - 1;
+    for (char c; y < z; ++y, --z)
+        c = s[y], s[y] = s[z], s[z] = c;
+    return i;
+}
+
 uint8 itoa_fill(uint32 n, char *dest, uint8 fill_to) {
     uint8 i = 0, z = 0, j;
     char tmp;
@@ -135,7 +135,7 @@ void admin_process_request(uint8 state) {
             return;
         }
         __atomic_store_n(admin_proc, false, __ATOMIC_RELAXED);
-        __atomic_store_n(data_json_changed, true, __ATOMIC_RELAXED);
+        __atomic_add_fetch(monitoring_reload, 1, __ATOMIC_RELAXED);
         uint16 len = 0;
         str_append(http_buf, &len, "HTTP/1.1 200\r\nContent-Length: 0\r\nConnection: close\r\n");
         if (memcmp(hash_str, admin_hash, 64)) {
@@ -153,22 +153,10 @@ enum {
     PAGE_PERMISSION_ERROR,
     PAGE_SHOW_ALL,
     PAGE_SUCCESS
-} PACKED get_page_from_buf(uint8 name_starting_from, json_object **name, json_object **monitors, bool admin) {
-    char *page = http_buf + name_starting_from;
-    for (uint16 i = 0; i < (uint32)len - name_starting_from; ++i) {
-        if (page[i] == '\r' || page[i] == '\n')
-            return PAGE_ERROR;
-        if (page[i] == ' ' || page[i] == '/') {
-            page[i] = '\0';
-            break;
-        }
-    }
+} PACKED get_page(const char *page, json_object **name, json_object **monitors, bool admin) {
     if (!page[0]) {
-        if (admin) {
-            if (name && !(*name = json_object_new_string("All servers")))
-                return PAGE_ERROR;
+        if (admin)
             return PAGE_SHOW_ALL;
-        }
         page = "main";
     }
     json_object *page_object, *page_name, *page_public, *page_monitors;
@@ -185,68 +173,367 @@ enum {
         *monitors = page_monitors;
     return PAGE_SUCCESS;
 }
+
+uint8 get_page_from_buf(uint8 name_starting_from, json_object **name, json_object **monitors, bool admin) { // the name is terminated in http_buf
+    char *page = http_buf + name_starting_from;
+    for (uint16 i = 0; i < (uint32)len - name_starting_from; ++i) {
+        if (page[i] == '\r' || page[i] == '\n')
+            return PAGE_ERROR;
+        if (page[i] == ' ' || page[i] == '/') {
+            page[i] = '\0';
+            break;
+        }
+    }
+    return get_page(page, name, monitors, admin);
+}
+
+// the API responses are written directly as JSON (in the same format as json-c with JSON_C_TO_STRING_PLAIN) into json_out instead of building json-c objects first. Every value is followed by a comma, json_close() replaces the one of the last value.
+#define JSON_BUF_SIZE 131072 // larger responses (only pages with very many monitors) are allocated
+#define JSON_HEADER_SPACE 256 // in front of the JSON, for the HTTP header
+char json_out_static[JSON_HEADER_SPACE + JSON_BUF_SIZE];
+char *json_out = json_out_static;
+uint32 json_out_len = JSON_HEADER_SPACE, json_out_size = sizeof(json_out_static);
+bool json_failed = false;
+char gzip_out_static[JSON_HEADER_SPACE + GZIP_BOUND(JSON_BUF_SIZE)]; // for the compressed response, see json_send()
+
+bool json_reserve(uint32 len) {
+    if (json_out_len + len <= json_out_size)
+        return true;
+    uint32 new_size = max(json_out_size * 2, json_out_len + len);
+    char *new_buf = json_failed ? NULL : json_out == json_out_static ? malloc(new_size) : realloc(json_out, new_size);
+    if (!new_buf) {
+        json_failed = true;
+        return false;
+    }
+    if (json_out == json_out_static)
+        memcpy(new_buf, json_out_static, json_out_len);
+    json_out = new_buf;
+    json_out_size = new_size;
+    return true;
+}
+
+void json_raw(const char *s, uint32 len) { // appended as is
+    if (!json_reserve(len))
+        return;
+    memcpy(json_out + json_out_len, s, len);
+    json_out_len += len;
+}
+
+#define json_open(c) json_raw(c, 1)
+void json_close(char c) {
+    if (!json_reserve(2))
+        return;
+    if (json_out[json_out_len - 1] == ',')
+        --json_out_len;
+    json_out[json_out_len++] = c;
+    json_out[json_out_len++] = ',';
+}
+
+void json_uint(uint64 value) {
+    if (!json_reserve(21))
+        return;
+    json_out_len += itoa64(value, json_out + json_out_len);
+    json_out[json_out_len++] = ',';
+}
+
+void json_int(int64 value) {
+    if (value < 0)
+        json_raw("-", 1);
+    json_uint(value < 0 ? -(uint64)value : (uint64)value);
+}
+
+void json_double(double value) { // like printf("%.2f"), which json-c uses (see main()), but without printf unless value * 100 is (almost) exactly between two integers, where the rounding error of the multiplication could make a difference
+    double hundredths = value * 100.0, fraction;
+    uint32 whole;
+    uint64 bits;
+    memcpy(&bits, &value, sizeof(uint64));
+    if ((bits >> 52 & 2047) == 2047) { // NaN or infinity, written like json-c does (isnan() and isinf() don't work with -Ofast)
+        if (bits << 12)
+            json_raw(SLEN("NaN,"));
+        else if (bits >> 63)
+            json_raw(SLEN("-Infinity,"));
+        else
+            json_raw(SLEN("Infinity,"));
+        return;
+    }
+    if (!json_reserve(350))
+        return;
+    if (value >= 0 && hundredths < 4294967295.0 && ((fraction = hundredths - (whole = hundredths)) < 0.5 - 1e-6 || fraction > 0.5 + 1e-6)) {
+        if (fraction > 0.5)
+            ++whole;
+        json_out_len += itoa(whole / 100, json_out + json_out_len);
+        json_out[json_out_len++] = '.';
+        json_out_len += itoa_fill(whole % 100, json_out + json_out_len, 2);
+    } else
+        json_out_len += snprintf(json_out + json_out_len, 350, "%.2f", value);
+    json_out[json_out_len++] = ',';
+}
+
+void json_bool(bool value) {
+    if (value)
+        json_raw(SLEN("true,"));
+    else
+        json_raw(SLEN("false,"));
+}
+
+void json_string(const char *s, uint32 len) {
+    static const char hex[] = "0123456789abcdef";
+    if (!json_reserve(len * 6 + 3))
+        return;
+    json_out[json_out_len++] = '"';
+    for (uint32 i = 0; i < len; ++i) {
+        uint8 c = s[i];
+        if (c >= ' ' && c != '"' && c != '\\' && c != '/') {
+            json_out[json_out_len++] = c;
+            continue;
+        }
+        json_out[json_out_len++] = '\\';
+        switch (c) {
+            case '\b': json_out[json_out_len++] = 'b'; break;
+            case '\n': json_out[json_out_len++] = 'n'; break;
+            case '\r': json_out[json_out_len++] = 'r'; break;
+            case '\t': json_out[json_out_len++] = 't'; break;
+            case '\f': json_out[json_out_len++] = 'f'; break;
+            case '"':
+            case '\\':
+            case '/':
+                json_out[json_out_len++] = c;
+                break;
+            default:
+                json_out[json_out_len++] = 'u';
+                json_out[json_out_len++] = '0';
+                json_out[json_out_len++] = '0';
+                json_out[json_out_len++] = hex[c >> 4];
+                json_out[json_out_len++] = hex[c & 15];
+        }
+    }
+    json_out[json_out_len++] = '"';
+    json_out[json_out_len++] = ',';
+}
+
+#define json_key(key) json_raw(SLEN("\"" key "\":"))
+void json_key_uint(uint32 key) {
+    if (!json_reserve(13))
+        return;
+    json_out[json_out_len++] = '"';
+    json_out_len += itoa(key, json_out + json_out_len);
+    json_out[json_out_len++] = '"';
+    json_out[json_out_len++] = ':';
+}
+
+void json_reverse(uint32 from, uint32 to) { // reverses json_out[from, to)
+    while (from + 1 < to) {
+        char c = json_out[from];
+        json_out[from++] = json_out[--to];
+        json_out[to] = c;
+    }
+}
+
+// json-c keeps the position of a key that is added to an object again and only replaces its value: if the key written at key_pos (the last one, its value is an array) was already written after from, the new value is moved there and the key removed
+void json_replace_duplicate_key(uint32 from, uint32 key_pos) {
+    uint32 key_len = 0, old_value_pos, old_value_len = 0, between_len, value_len;
+    if (json_failed)
+        return;
+    while (json_out[key_pos + key_len++] != ':');
+    value_len = json_out_len - key_pos - key_len;
+    for (uint32 pos = from; pos < key_pos; ++pos) {
+        if (json_out[pos] != '"' || memcmp(json_out + pos, json_out + key_pos, key_len)) // only the keys are strings
+            continue;
+        old_value_pos = pos + key_len;
+        while (json_out[old_value_pos + old_value_len++] != ']');
+        between_len = key_pos - old_value_pos - ++old_value_len; // with the comma
+        memmove(json_out + old_value_pos, json_out + old_value_pos + old_value_len, between_len);
+        memmove(json_out + old_value_pos + between_len, json_out + key_pos + key_len, value_len);
+        json_out_len = old_value_pos + between_len + value_len;
+        json_reverse(old_value_pos, old_value_pos + between_len); // the values between and the new one are swapped
+        json_reverse(old_value_pos + between_len, json_out_len);
+        json_reverse(old_value_pos, json_out_len);
+        return;
+    }
+}
+
+void json_value(json_object *value) { // for the values taken from data.json
+    switch (json_object_get_type(value)) {
+        case json_type_boolean:
+            json_bool(json_object_get_boolean(value));
+            break;
+        case json_type_int:
+            if (json_object_get_int64(value) < 0)
+                json_int(json_object_get_int64(value));
+            else
+                json_uint(json_object_get_uint64(value));
+            break;
+        case json_type_double:
+            json_double(json_object_get_double(value));
+            break;
+        case json_type_string:
+            json_string(json_object_get_string(value), json_object_get_string_len(value));
+            break;
+        case json_type_array:
+            json_open("[");
+            for (uint32 i = 0, count = json_object_array_length(value); i < count; ++i)
+                json_value(json_object_array_get_idx(value, i));
+            json_close(']');
+            break;
+        case json_type_object: {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // allow ({}) in foreach
+            json_open("{");
+            json_object_object_foreach(value, key, val) {
+                json_string(key, strlen(key));
+                json_out[json_out_len - 1] = ':'; // instead of the comma
+                json_value(val);
+            }
+            json_close('}');
+#pragma GCC diagnostic pop
+            break;
+        }
+        default:
+            json_raw(SLEN("null,"));
+    }
+}
+
+void json_move_to_front(uint32 from) { // moves everything written since json_out_len was from in front of everything else, for values that are only known after the ones that follow them were written
+    uint32 moved_len = json_out_len - from;
+    if (!json_reserve(moved_len))
+        return;
+    memcpy(json_out + json_out_len, json_out + from, moved_len);
+    memmove(json_out + JSON_HEADER_SPACE + moved_len, json_out + JSON_HEADER_SPACE, from - JSON_HEADER_SPACE);
+    memcpy(json_out + JSON_HEADER_SPACE, json_out + json_out_len, moved_len);
+}
+
+void json_send(bool binary) { // sends json_out (without the comma after the last value, unless binary) as the response
+    char header[JSON_HEADER_SPACE];
+    uint16 header_len = 0;
+    if (json_failed) {
+        json_out_len = JSON_HEADER_SPACE, json_failed = false;
+        return;
+    }
+    if (binary)
+        str_append(header, &header_len, "HTTP/1.1 200\r\nContent-Type: application/octet-stream\r\n");
+    else {
+        --json_out_len;
+        str_append(header, &header_len, "HTTP/1.1 200\r\nContent-Type: application/json\r\n");
+    }
+    str_append(header, &header_len, "Connection: close\r\nCache-Control: no-cache\r\nETag: ");
+    etag_append(header, &header_len, response_etag);
+    str_append(header, &header_len, "\r\n");
+    char *body = json_out + JSON_HEADER_SPACE, *compressed = NULL;
+    uint32 body_len = json_out_len - JSON_HEADER_SPACE;
+    if (SERVER_GZIP_MIN_SIZE) {
+        str_append(header, &header_len, "Vary: Accept-Encoding\r\n");
+        if (accepted_encodings & ENCODING_GZIP && body_len >= SERVER_GZIP_MIN_SIZE) {
+            compressed = GZIP_BOUND(body_len) <= sizeof(gzip_out_static) - JSON_HEADER_SPACE ? gzip_out_static : malloc(JSON_HEADER_SPACE + GZIP_BOUND(body_len));
+            uint32 compressed_len;
+            if (compressed && (compressed_len = gzip((uint8 *)body, body_len, (uint8 *)compressed + JSON_HEADER_SPACE)) < body_len) {
+                str_append(header, &header_len, "Content-Encoding: gzip\r\n");
+                body = compressed + JSON_HEADER_SPACE;
+                body_len = compressed_len;
+            }
+        }
+    }
+    str_append(header, &header_len, "Content-Length: ");
+    str_append_uint(header, &header_len, body_len);
+    str_append(header, &header_len, "\r\n\r\n");
+    memcpy(body - header_len, header, header_len);
+    client_write_len(body - header_len, body_len + header_len);
+    if (compressed && compressed != gzip_out_static)
+        free(compressed);
+    json_out_len = JSON_HEADER_SPACE;
+}
+
 #define HANDLE_HIDE(type) \
     if (!admin && !monitor->public && should_hide[SHOULD_HIDE_##type]) \
-        json_object_array_add(monitor_data, minus_one); \
+        json_raw(SLEN("-1,")); \
     else
-#define ADD_DOUBLE_FROM_TWO_UINTS(to, name) json_object_array_add(to, json_object_new_double(TO_DOUBLE_FROM_TWO_UINTS(monitor->stats.name)))
-json_object *get_monitor_details_json(monitor_details_t *monitor, json_object *monitor_name, uint32 now, bool admin) {
-    uint32 down_seconds = now - monitor->stats.time; // handle different times, assume that the monitor is offline if there's a significant clock difference to make the user aware
-    if (monitor->stats.time > now) {
-        if (monitor->stats.time - now > 20) // allow minor clock differences
+#define ADD_DOUBLE_FROM_TWO_UINTS(name) json_double(TO_DOUBLE_FROM_TWO_UINTS(monitor->state->stats.name))
+uint32 monitor_down_seconds(monitor_details_t *monitor, uint32 now) {
+    uint32 down_seconds = now - monitor->state->stats.time; // handle different times, assume that the monitor is offline if there's a significant clock difference to make the user aware
+    if (monitor->state->stats.time > now) {
+        if (monitor->state->stats.time - now > 20) // allow minor clock differences
             down_seconds = (uint32)-1;
         else
             down_seconds = 0;
     }
-    json_object *monitor_data, *minus_one = json_object_new_int(-1);
-    if (!monitor ||
-        !(monitor_data = json_object_new_array()))
-        return NULL;
-    json_object_array_add(monitor_data, monitor_name);
-    if (monitor->was_online && down_seconds < DECLARE_DOWN_IF_N_SECONDS_WITHOUT_DATA) {
-        HANDLE_HIDE(KERNEL) json_object_array_add(monitor_data, json_object_new_string_len(monitor->details.linux_version, monitor->details.linux_version_len));
-        HANDLE_HIDE(CPU_MODEL) json_object_array_add(monitor_data, json_object_new_string_len(monitor->details.cpu_model, monitor->details.cpu_model_len));
-        HANDLE_HIDE(CPU_CORES) json_object_array_add(monitor_data, json_object_new_uint64(monitor->details.cpu_cores));
-        HANDLE_HIDE(UPTIME) json_object_array_add(monitor_data, json_object_new_uint64(monitor->details.uptime));
-        HANDLE_HIDE(CPU_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(monitor_data, cpu_usage);
-        HANDLE_HIDE(CPU_IOWAIT) ADD_DOUBLE_FROM_TWO_UINTS(monitor_data, cpu_iowait);
-        HANDLE_HIDE(CPU_STEAL) ADD_DOUBLE_FROM_TWO_UINTS(monitor_data, cpu_steal);
-        HANDLE_HIDE(RAM_SIZE) json_object_array_add(monitor_data, json_object_new_uint64(monitor->details.ram_size));
-        HANDLE_HIDE(RAM_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(monitor_data, ram_usage);
-        HANDLE_HIDE(SWAP_SIZE) json_object_array_add(monitor_data, json_object_new_uint64(monitor->details.swap_size));
-        HANDLE_HIDE(SWAP_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(monitor_data, swap_usage);
-        HANDLE_HIDE(DISK_SIZE) json_object_array_add(monitor_data, json_object_new_uint64(monitor->details.disk_size));
-        HANDLE_HIDE(DISK_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(monitor_data, disk_usage);
-        if (monitor->time_diff) {
-            HANDLE_HIDE(NET) json_object_array_add(monitor_data, json_object_new_uint64(monitor->stats.rx_bytes / monitor->time_diff));
-            HANDLE_HIDE(NET) json_object_array_add(monitor_data, json_object_new_uint64(monitor->stats.tx_bytes / monitor->time_diff));
-            HANDLE_HIDE(IO) json_object_array_add(monitor_data, json_object_new_uint64(SECTOR_SIZE * (monitor->stats.read_sectors / monitor->time_diff)));
-            HANDLE_HIDE(IO) json_object_array_add(monitor_data, json_object_new_uint64(SECTOR_SIZE * (monitor->stats.written_sectors / monitor->time_diff)));
+    return down_seconds;
+}
+
+#define API_CACHE_HEADERS (SERVER_GZIP_MIN_SIZE ? "Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n" : "Cache-Control: no-cache\r\n")
+uint64 etag_api(bool admin) { // what all API responses depend on
+    return etag_add(etag_add(etag_add(etag_add(ETAG_INITIAL, server_started), data_json_generation), admin), accepted_encodings & ENCODING_GZIP);
+}
+
+uint64 etag_add_monitor(uint64 etag, monitor_details_t *monitor, uint32 now, uint32 offline_unit) { // everything json_monitor_details() and the data depend on, except for data.json; the offline time only counts in offline_unit seconds
+    uint32 down_seconds = monitor_down_seconds(monitor, now);
+    etag = etag_add(etag, __atomic_load_n(&monitor->state->version, __ATOMIC_ACQUIRE)); // before anything else is read
+    return etag_add(etag, !monitor->state->was_online ? 0 : down_seconds < DECLARE_DOWN_IF_N_SECONDS_WITHOUT_DATA ? 1 : (uint64)down_seconds / offline_unit + 2); // the offline time changes without uploads
+}
+
+bool json_monitor_details(monitor_details_t *monitor, json_object *monitor_name, uint32 now, bool admin) { // the array isn't closed so that the caller can add further values
+    if (!monitor)
+        return false;
+    uint32 down_seconds = monitor_down_seconds(monitor, now);
+    json_open("[");
+    json_value(monitor_name);
+    if (monitor->state->was_online && down_seconds < DECLARE_DOWN_IF_N_SECONDS_WITHOUT_DATA) {
+        HANDLE_HIDE(KERNEL) json_string(monitor->state->details.linux_version, monitor->state->details.linux_version_len);
+        HANDLE_HIDE(CPU_MODEL) json_string(monitor->state->details.cpu_model, monitor->state->details.cpu_model_len);
+        HANDLE_HIDE(CPU_CORES) json_uint(monitor->state->details.cpu_cores);
+        HANDLE_HIDE(UPTIME) json_uint(monitor->state->details.uptime);
+        HANDLE_HIDE(CPU_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(cpu_usage);
+        HANDLE_HIDE(CPU_IOWAIT) ADD_DOUBLE_FROM_TWO_UINTS(cpu_iowait);
+        HANDLE_HIDE(CPU_STEAL) ADD_DOUBLE_FROM_TWO_UINTS(cpu_steal);
+        HANDLE_HIDE(RAM_SIZE) json_uint(monitor->state->details.ram_size);
+        HANDLE_HIDE(RAM_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(ram_usage);
+        HANDLE_HIDE(SWAP_SIZE) json_uint(monitor->state->details.swap_size);
+        HANDLE_HIDE(SWAP_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(swap_usage);
+        HANDLE_HIDE(DISK_SIZE) json_uint(monitor->state->details.disk_size);
+        HANDLE_HIDE(DISK_USAGE) ADD_DOUBLE_FROM_TWO_UINTS(disk_usage);
+        if (monitor->state->time_diff) {
+            HANDLE_HIDE(NET) json_uint(monitor->state->stats.rx_bytes / monitor->state->time_diff);
+            HANDLE_HIDE(NET) json_uint(monitor->state->stats.tx_bytes / monitor->state->time_diff);
+            HANDLE_HIDE(IO) json_uint(SECTOR_SIZE * (monitor->state->stats.read_sectors / monitor->state->time_diff));
+            HANDLE_HIDE(IO) json_uint(SECTOR_SIZE * (monitor->state->stats.written_sectors / monitor->state->time_diff));
         } else { // shouldn't (can't?) occur, but doesn't hurt to check
-            HANDLE_HIDE(NET) json_object_array_add(monitor_data, json_object_new_uint64(0));
-            HANDLE_HIDE(NET) json_object_array_add(monitor_data, json_object_new_uint64(0));
-            HANDLE_HIDE(IO) json_object_array_add(monitor_data, json_object_new_uint64(0));
-            HANDLE_HIDE(IO) json_object_array_add(monitor_data, json_object_new_uint64(0));
+            HANDLE_HIDE(NET) json_uint(0);
+            HANDLE_HIDE(NET) json_uint(0);
+            HANDLE_HIDE(IO) json_uint(0);
+            HANDLE_HIDE(IO) json_uint(0);
         }
-    } else if (monitor->was_online && down_seconds != (uint32)-1)
-        json_object_array_add(monitor_data, json_object_new_uint64(down_seconds - 60));
+    } else if (monitor->state->was_online && down_seconds != (uint32)-1)
+        json_uint((uint32)(down_seconds - 60));
     else
-        json_object_array_add(monitor_data, NULL);
-    return monitor_data;
+        json_raw(SLEN("null,"));
+    return true;
 }
 
 #define SHOULD_SHOW(i) (admin || monitor->public || !should_hide[i])
 
-void api_page_add_element(json_object *response_monitors, uint64 *rx, uint64 *tx, json_object *monitor_name, json_object *public_id, const char *public_id_str, uint32 now, int32 id, bool admin) {
+// if etag isn't NULL, the monitor is only added to it. If sent isn't NULL, the monitor is only written if it changed since *sent was set (see /api/stream/page/{PAGE}), the traffic is added in any case.
+void api_page_add_element(uint64 *etag, uint64 *sent, uint64 *rx, uint64 *tx, json_object *monitor_name, const char *public_id_str, uint32 now, int32 id, bool admin) {
     monitor_details_t *monitor = id == -1 ? get_monitor_details_by_public(public_id_str) : &details[id];
-    json_object *monitor_data = get_monitor_details_json(monitor, monitor_name, now, admin);
-    if (!monitor_data)
+    if (!monitor)
         return;
-    json_object_array_add(monitor_data, public_id);
-    json_object_array_add(response_monitors, monitor_data);
+    if (etag) {
+        *etag = etag_add_monitor(*etag, monitor, now, 1); // the offline time is in seconds
+        return;
+    }
+    if (sent) {
+        if (monitor->stream_tag_check != streams_check_id) { // the same for all streams
+            monitor->stream_tag = etag_add_monitor(ETAG_INITIAL, monitor, now, 60); // the status page only shows the offline minutes
+            monitor->stream_tag_check = streams_check_id;
+        }
+        if (monitor->stream_tag == *sent)
+            goto traffic;
+        *sent = monitor->stream_tag;
+    }
+    json_monitor_details(monitor, monitor_name, now, admin);
+    json_string(public_id_str, 32);
+    json_close(']');
+traffic:
     if (SHOULD_SHOW(SHOULD_HIDE_TOTAL_TRAFFIC)) {
-        *rx += monitor->rx_total;
-        *tx += monitor->tx_total;
+        *rx += monitor->state->rx_total;
+        *tx += monitor->state->tx_total;
     }
 }
 
@@ -264,14 +551,7 @@ Output json:
     - traffic: [rx_total_bytes: uint, tx_total_bytes: uint]
 */
 
-void api_page(void) {
-    json_object *page_name, *page_monitors, *response, *response_monitors, *traffic;
-    bool admin = is_logged_in();
-    uint8 state = get_page_from_buf(strlen("GET /api/page/"), &page_name, &page_monitors, admin);
-    if (state == PAGE_ERROR || state == PAGE_PERMISSION_ERROR || !(response = json_object_new_object()) || !(response_monitors = json_object_new_array()) || !(traffic = json_object_new_array()) || json_object_object_add(response, "name", page_name) || json_object_object_add(response, "monitors", response_monitors) || json_object_object_add(response, "traffic", traffic))
-        return;
-    uint32 now = time(NULL);
-    uint64 rx = 0, tx = 0;
+void api_page_monitors(uint8 state, json_object *page_monitors, uint64 *etag, uint64 *sent, uint64 *rx, uint64 *tx, uint32 now, bool admin) { // sent (if not NULL) has an element for every position in the page (or in details)
     if (state == PAGE_SUCCESS)
         for (uint32 pos = 0, count = json_object_array_length(page_monitors); pos < count; ++pos) {
             json_object *public_id = json_object_array_get_idx(page_monitors, pos), *monitor_info, *monitor_name;
@@ -280,46 +560,349 @@ void api_page(void) {
                 !json_object_object_get_ex(monitors, public_id_str, &monitor_info) ||
                 !(monitor_name = json_object_array_get_idx(monitor_info, 1)) || !json_object_is_type(monitor_name, json_type_string))
                 continue;
-            api_page_add_element(response_monitors, &rx, &tx, monitor_name, public_id, public_id_str, now, -1, admin);
+            api_page_add_element(etag, sent ? &sent[pos] : NULL, rx, tx, monitor_name, public_id_str, now, -1, admin);
         }
     else if (state == PAGE_SHOW_ALL) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic" // allow ({}) in foreach
         uint32 pos = 0;
         json_object_object_foreach(monitors, public_id_str, val) {
-            json_object *monitor_name, *public_id;
-            if (strlen(public_id_str) != 32 || !(monitor_name = json_object_array_get_idx(val, 1)) || !(public_id = json_object_new_string_len(public_id_str, 32))) {
+            json_object *monitor_name;
+            if (strlen(public_id_str) != 32 || !(monitor_name = json_object_array_get_idx(val, 1))) {
                 ++pos;
                 continue;
             }
-            api_page_add_element(response_monitors, &rx, &tx, monitor_name, public_id, public_id_str, now, (int32)pos, admin);
+            api_page_add_element(etag, sent ? &sent[pos] : NULL, rx, tx, monitor_name, public_id_str, now, (int32)pos, admin);
             ++pos;
         }
-    }
 #pragma GCC diagnostic pop
-    json_object_array_add(traffic, json_object_new_uint64(rx));
-    json_object_array_add(traffic, json_object_new_uint64(tx));
-    client_write_json(response);
+    }
+}
+
+void api_page_json(uint8 state, json_object *page_name, json_object *page_monitors, uint64 *sent, uint32 now, bool admin) {
+    uint64 rx = 0, tx = 0;
+    json_open("{");
+    json_key("name");
+    if (state == PAGE_SHOW_ALL)
+        json_string(SLEN("All servers"));
+    else
+        json_value(page_name);
+    json_key("monitors");
+    json_open("[");
+    api_page_monitors(state, page_monitors, NULL, sent, &rx, &tx, now, admin);
+    json_close(']');
+    json_key("traffic");
+    json_open("[");
+    json_uint(rx);
+    json_uint(tx);
+    json_close(']');
+    json_close('}');
+}
+
+void api_page(void) {
+    json_object *page_name = NULL, *page_monitors = NULL; // not set for PAGE_SHOW_ALL
+    bool admin = is_logged_in();
+    uint8 state = get_page_from_buf(strlen("GET /api/page/"), &page_name, &page_monitors, admin);
+    if (state == PAGE_ERROR || state == PAGE_PERMISSION_ERROR)
+        return;
+    uint32 now = time(NULL);
+    uint64 etag = etag_api(admin);
+    api_page_monitors(state, page_monitors, &etag, NULL, NULL, NULL, now, admin);
+    if (etag_not_modified(etag, API_CACHE_HEADERS))
+        return;
+    api_page_json(state, page_name, page_monitors, NULL, now, admin);
+    json_send(false);
 }
 
 /*
-/api/data/{PUBLIC_ID}/{PERIOD}/{BACK}
+/api/stream/page/{PAGE}
+Server-sent events (text/event-stream) with the changes of a page, {PAGE} like for /api/page/{PAGE}. The streams are kept open by the worker itself (not by a child), which checks the monitors every STREAM_CHECK_MS.
+
+Events:
+    - page: the output json of /api/page/{PAGE}, sent first and again whenever data.json was changed
+    - monitors: {monitors: [the monitors of the page (like in /api/page/{PAGE}) that changed since they were last sent], traffic: like in /api/page/{PAGE}}, offline monitors are sent again every minute
+The streams of admins are closed when data.json was changed instead, as the password may have been changed.
+*/
+
+bool stream_write(stream_t *stream, const char *s, uint32 l) { // never waits for the client: what the socket doesn't take is buffered, false if the buffer is full or the connection failed
+    int32 written = 0;
+    if (!stream->buf_len && (written = write(stream->fd, s, l)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        written = 0;
+    }
+    if ((uint32)written == l)
+        return true;
+    s += written, l -= written;
+    if (stream->buf_len + l > STREAM_BUFFER_SIZE || (!stream->buf && !(stream->buf = malloc(STREAM_BUFFER_SIZE))))
+        return false;
+    memcpy(stream->buf + stream->buf_len, s, l);
+    stream->buf_len += l;
+    return true;
+}
+
+bool stream_flush(stream_t *stream) { // writes as much of the buffer as the socket takes, false if the connection failed
+    int32 written;
+    if (!stream->buf_len)
+        return true;
+    if ((written = write(stream->fd, stream->buf, stream->buf_len)) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    memmove(stream->buf, stream->buf + written, stream->buf_len -= written);
+    return true;
+}
+
+void stream_close(stream_t *stream) {
+    close(stream->fd);
+    free(stream->page);
+    if (stream->sent)
+        free(stream->sent);
+    if (stream->buf)
+        free(stream->buf);
+}
+
+bool stream_send(stream_t *stream, const char *event) { // sends the json in json_out as an event, false if that failed
+    char header[JSON_HEADER_SPACE];
+    uint16 header_len = 0;
+    bool success = false;
+    if (!json_failed) {
+        json_out[json_out_len - 1] = '\n'; // instead of the comma after the last value
+        json_raw("\n", 1);
+    }
+    if (!json_failed) {
+        str_append(header, &header_len, "event: ");
+        str_append(header, &header_len, event);
+        str_append(header, &header_len, "\ndata: ");
+        memcpy(json_out + JSON_HEADER_SPACE - header_len, header, header_len);
+        if ((success = stream_write(stream, json_out + JSON_HEADER_SPACE - header_len, json_out_len - JSON_HEADER_SPACE + header_len)))
+            stream->heartbeat_at = monotonic_ms() + STREAM_HEARTBEAT_MS;
+    }
+    json_out_len = JSON_HEADER_SPACE, json_failed = false;
+    return success;
+}
+
+bool stream_page(stream_t *stream, uint32 now) { // sends the page event, false if the page doesn't exist (anymore) or it couldn't be sent
+    json_object *page_name = NULL, *page_monitors = NULL; // not set for PAGE_SHOW_ALL
+    uint8 state = get_page(stream->page, &page_name, &page_monitors, stream->admin);
+    if (state == PAGE_ERROR || state == PAGE_PERMISSION_ERROR)
+        return false;
+    uint32 count = state == PAGE_SHOW_ALL ? details_count : json_object_array_length(page_monitors);
+    uint64 *sent = calloc(max(count, 1), sizeof(uint64)); // 0 is never the tag of a monitor, so all are written
+    if (!sent)
+        return false;
+    if (stream->sent)
+        free(stream->sent);
+    stream->sent = sent;
+    stream->state = state;
+    stream->page_monitors = page_monitors;
+    stream->generation = data_json_generation;
+    api_page_json(state, page_name, page_monitors, sent, now, stream->admin);
+    return stream_send(stream, "page");
+}
+
+bool stream_monitors(stream_t *stream, uint32 now) { // sends the monitors event if any monitor changed, false if it couldn't be sent
+    uint64 rx = 0, tx = 0;
+    json_open("{");
+    json_key("monitors");
+    json_open("[");
+    uint32 monitors_pos = json_out_len;
+    api_page_monitors(stream->state, stream->page_monitors, NULL, stream->sent, &rx, &tx, now, stream->admin);
+    if (json_out_len == monitors_pos) {
+        json_out_len = JSON_HEADER_SPACE, json_failed = false;
+        return true;
+    }
+    json_close(']');
+    json_key("traffic");
+    json_open("[");
+    json_uint(rx);
+    json_uint(tx);
+    json_close(']');
+    json_close('}');
+    return stream_send(stream, "monitors");
+}
+
+bool stream_open(void) { // called by the worker, the connection belongs to the stream if it returns true
+    json_object *page_name = NULL, *page_monitors = NULL; // not set for PAGE_SHOW_ALL
+    bool admin = is_logged_in();
+    uint8 state = get_page_from_buf(strlen("GET /api/stream/page/"), &page_name, &page_monitors, admin);
+    if (state == PAGE_ERROR || state == PAGE_PERMISSION_ERROR)
+        return false;
+    if (streams_count == SERVER_MAX_STREAMS) {
+        client_write("HTTP/1.1 503\r\nConnection: close\r\n\r\n");
+        return false;
+    }
+    stream_t *stream = &streams[streams_count];
+    const char *page = http_buf + strlen("GET /api/stream/page/");
+    if (!(stream->page = malloc(strlen(page) + 1)))
+        return false;
+    memcpy(stream->page, page, strlen(page) + 1);
+    stream->fd = client;
+    stream->admin = admin;
+    stream->sent = NULL;
+    stream->buf = NULL;
+    stream->buf_len = 0;
+    if (!stream_write(stream, SLEN("HTTP/1.1 200\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nX-Accel-Buffering: no\r\nConnection: close\r\n\r\n")) || !stream_page(stream, time(NULL))) { // X-Accel-Buffering: so that nginx doesn't buffer the events
+        free(stream->page);
+        if (stream->sent)
+            free(stream->sent);
+        if (stream->buf)
+            free(stream->buf);
+        return false;
+    }
+    ++streams_count;
+    return true;
+}
+
+void streams_check(void) { // sends the changes to all streams, the ones that fail are closed
+    uint32 now = time(NULL);
+    uint64 now_ms = monotonic_ms();
+    streams_check_at = now_ms + STREAM_CHECK_MS;
+    ++streams_check_id;
+    for (uint32 i = 0; i < streams_count;) {
+        stream_t *stream = &streams[i];
+        bool success = stream_flush(stream);
+        if (success && stream->generation != data_json_generation)
+            success = !stream->admin && stream_page(stream, now);
+        else if (success)
+            success = stream_monitors(stream, now);
+        if (success && now_ms >= stream->heartbeat_at) { // so that closed connections are noticed
+            if ((success = stream_write(stream, SLEN(":\n\n"))))
+                stream->heartbeat_at = now_ms + STREAM_HEARTBEAT_MS;
+        }
+        if (success) {
+            ++i;
+            continue;
+        }
+        stream_close(stream);
+        *stream = streams[--streams_count];
+    }
+}
+
+/*
+/api/data/{PUBLIC_ID}/{PERIOD}/{BACK}[?OPTIONS]
 
 {PERIOD} is either 3h, 6h, 12h, 3d, 7d, 14d, 28d, 3m, 6m, 1y, 2y
 {BACK} is a positive (or 0) integer that indicated how many periods it should go back, i.e. when BACK=0 and PERIOD=3h, the last 3 hours will be sent, when BACK=1 and PERIOD=3h the 3 hours before that, and so forth.
 
+/api/data/{PUBLIC_ID}?from={FROM}&to={TO}[&OPTIONS]
+The same for any time range instead of a period: {FROM} and {TO} are UNIX timestamps (from <= time < to).
+
+{OPTIONS} are separated by &:
+    - points={POINTS}: the timespan is split into {POINTS} (at most 360, by default 360) datapoints, but there can't be more datapoints than measurements in it
+    - envelope: instead of the averages, every datapoint is split into two: one with the minima (at the time of its first measurement) and one with the maxima (at the time of its last measurement), so that short spikes aren't flattened; there are half as many of these pairs as {POINTS}
+    - binary: see below
+
 DATA_ELEMENT=cpu_usage: double, cpu_iowait: double, cpu_steal: double, ram_usage: double, swap_usage: double, disk_usage: double, rx_bytes_per_second: uint, tx_bytes_per_second: uint, disk_read_bytes_per_second: uint, disk_write_bytes_per_second: uint. Any of those values may be missing if they are hidden, to figure out what values are hidden, details or hidden can be used.
 Output json:
     - details: [name: string, offline_details: uint|null] when the monitor is offline, with offline_details being the seconds since no data was received or null if no data was received since the start of the server, or, when the monitor is online [name: string, kernel_version: string, cpu_model: string, cpu_cores: uint, uptime: uint (in seconds), cpu_usage: double, cpu_iowait: double, cpu_steal: double, ram_size: uint (in bytes), ram_usage: double, swap_size: uint (in bytes), swap_usage: double, disk_size: uint (in bytes), disk_usage: double, rx_bytes_per_second: uint, tx_bytes_per_second: uint, disk_read_bytes_per_second: uint, disk_write_bytes_per_second: uint]. Any of those values except for name, offline_details and public id may be -1 if the value is hidden.
     - max: [DATA_ELEMENT] (the maxima in this timespan)
     - avg: [DATA_ELEMENT] (the averages in this timespan)
+    - p50, p95, p99: [DATA_ELEMENT] (the percentiles in this timespan, estimated with t-digests, which are stored in the rollup files for the longer periods)
     - traffic: [rx_bytes_in_timespan: uint, tx_bytes_in_timespan: uint, rx_bytes_total: uint, tx_bytes_total: uint]. This element may be missing if it's supposed to be hidden.
     - io: [disk_read_bytes_in_timespan: uint, disk_write_bytes_in_timespan: uint, disk_read_bytes_total: uint, disk_write_bytes_total: uint]. This element may be missing if it's supposed to be hidden.
     - data: object of maximum 400 (360 + 40 in case a downtime is between elements) DATA_ELEMENTs, if period is over 6h (6h: 6 * 60 => 360 datapoints), the averages over datapoints/360 will each be calculated, the key is the UNIX timestamp
     - hidden: [DATA_ELEMENT, except that the values are booleans and not doubles/uints]. Indicates what values are hidden.
     - notes: false|string Custom notes regarding that monitor.
+
+With ?binary, the response is binary (all values little endian and 4-byte aligned, so that they can be used as typed arrays directly) instead:
+    - json_len: uint32
+    - json: the output json without data, padded with spaces to json_len (a multiple of 4)
+    - count: uint32, the number of datapoints
+    - time: uint32[count], the UNIX timestamps in ascending order
+    - one float32[count] for each DATA_ELEMENT value that isn't hidden, in the same order
 */
 
+#define MAX_DATAPOINTS 400
+uint32 chart_time[MAX_DATAPOINTS];
+float chart_values[10][MAX_DATAPOINTS];
+uint16 chart_count;
+
+void chart_add(uint32 time, const double *values, const uint64 *values_uint, uint32 count) { // for ?binary, sorted by time like the keys of an object in JavaScript, a datapoint with the same time replaces the previous one
+    uint16 pos = chart_count;
+    while (pos && chart_time[pos - 1] > time)
+        --pos;
+    if (!pos || chart_time[pos - 1] != time) {
+        for (uint16 i = chart_count; i > pos; --i) {
+            chart_time[i] = chart_time[i - 1];
+            for (uint8 y = 0; y < 10; ++y)
+                chart_values[y][i] = chart_values[y][i - 1];
+        }
+        chart_time[pos] = time;
+        ++chart_count;
+    } else
+        --pos;
+    for (uint8 i = 0; i < 6; ++i)
+        chart_values[i][pos] = values[i] / count;
+    for (uint8 i = 0; i < 4; ++i)
+        chart_values[6 + i][pos] = values_uint[i] / count;
+}
+
+// the percentiles are estimated with a t-digest per value: all datapoints (or the centroids of the rollup intervals, see centroids_add()) are collected, and once DIGEST_BUFFER are reached they are sorted and merged down to around DIGEST_COMPRESSION * 1.5 centroids
+#define DIGEST_COMPRESSION 100
+#define DIGEST_BUFFER 1000
+typedef struct {
+    double mean;
+    uint64 count;
+} digest_centroid_t;
+typedef struct {
+    uint32 count;
+    digest_centroid_t centroids[DIGEST_BUFFER];
+} digest_t;
+digest_t digests[10];
+
+int digest_compare(const void *a, const void *b) {
+    double mean_a = ((const digest_centroid_t *)a)->mean, mean_b = ((const digest_centroid_t *)b)->mean;
+    return (mean_a > mean_b) - (mean_a < mean_b);
+}
+
+void digest_compress(digest_t *digest) { // sorts the centroids and merges neighbours as long as a centroid at quantile q has at most 4 * total * q * (1 - q) / DIGEST_COMPRESSION values
+    uint64 total = 0, before = 0;
+    uint32 out = 0;
+    if (!digest->count)
+        return;
+    qsort(digest->centroids, digest->count, sizeof(digest_centroid_t), digest_compare);
+    for (uint32 i = 0; i < digest->count; ++i)
+        total += digest->centroids[i].count;
+    for (uint32 i = 1; i < digest->count; ++i) {
+        digest_centroid_t *current = &digest->centroids[out], *next = &digest->centroids[i];
+        uint64 merged = current->count + next->count;
+        double q = (before + merged / 2.0) / total;
+        if (merged <= 4.0 * total * q * (1.0 - q) / DIGEST_COMPRESSION) {
+            current->mean = (current->mean * current->count + next->mean * next->count) / merged;
+            current->count = merged;
+        } else {
+            before += current->count;
+            digest->centroids[++out] = *next;
+        }
+    }
+    digest->count = out + 1;
+}
+
+void digest_add(digest_t *digest, double mean, uint64 count) {
+    if (digest->count == DIGEST_BUFFER)
+        digest_compress(digest);
+    digest->centroids[digest->count].mean = mean;
+    digest->centroids[digest->count++].count = count;
+}
+
+double digest_quantile(const digest_t *digest, double q) { // digest_compress() has to be called first; interpolated between the centers of the centroids
+    uint64 total = 0, before = 0;
+    if (!digest->count)
+        return 0.0;
+    for (uint32 i = 0; i < digest->count; ++i)
+        total += digest->centroids[i].count;
+    double target = q * total, center = digest->centroids[0].count / 2.0;
+    if (target <= center)
+        return digest->centroids[0].mean;
+    for (uint32 i = 0; i + 1 < digest->count; ++i) {
+        before += digest->centroids[i].count;
+        double next_center = before + digest->centroids[i + 1].count / 2.0;
+        if (target <= next_center)
+            return digest->centroids[i].mean + (digest->centroids[i + 1].mean - digest->centroids[i].mean) * (target - center) / (next_center - center);
+        center = next_center;
+    }
+    return digest->centroids[digest->count - 1].mean;
+}
+
 #define MAP_PERIOD(str, elements) if (!memcmp(period, str, sizeof(str))) return elements
 uint32 period_to_elements(const char *period) {
     MAP_PERIOD("6h", 360);
@@ -339,25 +922,78 @@ uint32 period_to_elements(const char *period) {
 #define IF_SHOULD_SHOW(i) \
     if (SHOULD_SHOW(i))
 
-#define ADD_DATA(to, data, data_uint) \
+#define ADD_DATA(data, data_uint) \
+    json_open("["); \
     for (uint8 i = 0; i < 6; ++i) \
-        IF_SHOULD_SHOW(i_to_id_percent[i]) json_object_array_add(to, json_object_new_double(data)); \
+        IF_SHOULD_SHOW(i_to_id_percent[i]) json_double(data); \
     for (uint8 i = 0; i < 4; ++i) \
-        IF_SHOULD_SHOW(i_to_id_uint[i]) json_object_array_add(to, json_object_new_uint64(data_uint)); \
+        IF_SHOULD_SHOW(i_to_id_uint[i]) json_uint(data_uint); \
+    json_close(']');
+
+#define ADD_DATAPOINT_VALUES(datapoint_time_value, values, values_uint, n) \
+    { \
+        uint32 time = datapoint_time_value; \
+        if (binary) \
+            chart_add(time, values, values_uint, n); \
+        else { \
+            uint32 key_pos = json_out_len; \
+            json_key_uint(time); \
+            ADD_DATA(values[i] / n, values_uint[i] / n); \
+            if (time > datapoint_time_max) \
+                datapoint_time_max = time; \
+            else /* possibly the same key again (the data isn't sorted by time if the time of an agent went backwards) */ \
+                json_replace_duplicate_key(datapoints_start, key_pos); \
+        } \
+        ++count_of_datapoints; \
+    }
+
+#define ADD_DATAPOINT() \
+    { \
+        if (envelope) { /* the minima at the time of the first element, the maxima at the time of the last one */ \
+            ADD_DATAPOINT_VALUES(envelope_time[0], envelope_values[0], envelope_values_uint[0], 1); \
+            if (envelope_time[1] != envelope_time[0]) \
+                ADD_DATAPOINT_VALUES(envelope_time[1], envelope_values[1], envelope_values_uint[1], 1); \
+        } else \
+            ADD_DATAPOINT_VALUES(sum_for_datapoint_avg_uint[4] / count_for_datapoint_avg, sum_for_datapoint_avg, sum_for_datapoint_avg_uint, count_for_datapoint_avg); \
+    }
+
+#define ADD_TO_ENVELOPE(first_time, last_time, min_values, max_values, min_values_uint, max_values_uint) /* before count_for_datapoint_avg is increased */ \
+    { \
+        if (!count_for_datapoint_avg) \
+            envelope_time[0] = first_time; \
+        envelope_time[1] = last_time; \
+        for (uint8 i = 0; i < 6; ++i) { \
+            double min_value = min_values, max_value = max_values; \
+            if (!count_for_datapoint_avg || min_value < envelope_values[0][i]) \
+                envelope_values[0][i] = min_value; \
+            if (!count_for_datapoint_avg || max_value > envelope_values[1][i]) \
+                envelope_values[1][i] = max_value; \
+        } \
+        for (uint8 i = 0; i < 4; ++i) { \
+            uint64 min_value = min_values_uint, max_value = max_values_uint; \
+            if (!count_for_datapoint_avg || min_value < envelope_values_uint[0][i]) \
+                envelope_values_uint[0][i] = min_value; \
+            if (!count_for_datapoint_avg || max_value > envelope_values_uint[1][i]) \
+                envelope_values_uint[1][i] = max_value; \
+        } \
+    }
+
+#define DATAPOINTS_FULL() (count_of_datapoints + (envelope ? 2 : 1) > MAX_DATAPOINTS) // no space for the next one
 
 #define MAX_BACK 10000
+#define MAX_POINTS 360 // for ?points=, so that there's space for the datapoints that are added because of downtimes
 void api_data(void) {
     const uint8 i_to_id_percent[] = { SHOULD_HIDE_CPU_USAGE, SHOULD_HIDE_CPU_IOWAIT, SHOULD_HIDE_CPU_STEAL, SHOULD_HIDE_RAM_USAGE, SHOULD_HIDE_SWAP_USAGE, SHOULD_HIDE_DISK_USAGE };
     const uint8 i_to_id_uint[] = { SHOULD_HIDE_NET, SHOULD_HIDE_NET, SHOULD_HIDE_IO, SHOULD_HIDE_IO };
     if ((uint32)len < strlen("GET /api/data//xx/0 HTTP/1.1\r\nHost:\r\n\r\n") + 32)
         return;
-    char *public_id = http_buf + strlen("GET /api/data/"), *period = public_id + 33;
+    char *public_id = http_buf + strlen("GET /api/data/"), *period = public_id + 33, separator = public_id[32];
     for (uint8 i = 0; i < 32; ++i)
         if (!isxdigit(public_id[i]))
             return;
     public_id[32] = '\0';
     monitor_details_t *monitor = get_monitor_details_by_public(public_id);
-    json_object *monitor_obj, *name, *response, *details_json, *max_json, *avg_json, *traffic_json = NULL, *io_json = NULL, *data_json, *hidden_json, *notes;
+    json_object *monitor_obj, *name, *notes;
     bool admin = is_logged_in();
     if (!monitor || !json_object_object_get_ex(monitors, public_id, &monitor_obj) || !json_object_is_type(monitor_obj, json_type_array) || !(name = json_object_array_get_idx(monitor_obj, 1)) || !json_object_is_type(name, json_type_string) || !(notes = json_object_array_get_idx(monitor_obj, 3)))
         return;
@@ -368,57 +1004,181 @@ void api_data(void) {
         if (json_object_get_boolean(public) || admin)
             notes = string;
         else
-            notes = json_object_new_boolean(false);
+            notes = NULL; // false
     } else if (!json_object_is_type(notes, json_type_boolean) || json_object_get_boolean(notes))
         return;
-    if (period[2] == '/')
-        period[2] = '\0';
-    else if (period[2] == 'h' || period[2] == 'd') // 12h/24h/14d/28d
-        period[3] = '\0';
+    uint32 now = time(NULL), points = 360, from = 0, to = 0, span;
+    uint64 etag = etag_add_monitor(etag_api(admin), monitor, now, 1);
+    int64 start = 0, end = 0;
+    bool binary = false, envelope = false;
+    char *param = NULL; // the query string
+    if (separator == '/') {
+        if (period[2] == '/')
+            period[2] = '\0';
+        else if (period[2] == 'h' || period[2] == 'd') // 12h/24h/14d/28d
+            period[3] = '\0';
+        else
+            return;
+        char *back_end;
+        uint32 elements = period_to_elements(period), back;
+        if (!elements || (back = (uint32)strtoul(period + (period[2] ? 4 : 3), &back_end, 10)) > MAX_BACK)
+            return;
+        if (*back_end == '?')
+            param = back_end + 1;
+        etag = etag_add(etag_add(etag, elements), back);
+        end = (int64)monitor->state->rollup_last_time + 1 - (int64)back * elements * 60, start = end - elements * 60; // the period ends with the last data received (elements are minutes)
+    } else if (separator == '?')
+        param = period;
     else
         return;
-    uint32 elements = period_to_elements(period), back, now = time(NULL);
-    if (!elements || (back = (uint32)strtoul(period + (period[2] ? 4 : 3), NULL, 10)) > MAX_BACK ||
-        !(response = json_object_new_object()) ||
-        !(details_json = json_object_new_array()) ||
-        !(max_json = json_object_new_array()) ||
-        !(avg_json = json_object_new_array()) ||
-        (SHOULD_SHOW(SHOULD_HIDE_TOTAL_TRAFFIC) && (!(traffic_json = json_object_new_array()) || json_object_object_add(response, "traffic", traffic_json))) ||
-        (SHOULD_SHOW(SHOULD_HIDE_TOTAL_IO) && (!(io_json = json_object_new_array()) || json_object_object_add(response, "io", io_json))) ||
-        !(data_json = json_object_new_object()) ||
-        !(hidden_json = json_object_new_array()) ||
-        json_object_object_add(response, "details", get_monitor_details_json(monitor, name, now, admin)) ||
-        json_object_object_add(response, "max", max_json) ||
-        json_object_object_add(response, "avg", avg_json) ||
-        json_object_object_add(response, "data", data_json) ||
-        json_object_object_add(response, "hidden", hidden_json) ||
-        json_object_object_add(response, "notes", notes))
-        return;
-    uint32 file_len = fd_size(monitor->fd), total_elements = file_len / sizeof(stats_t), go_back_n_elements = elements * (back + 1), pos = 0, average_over_n_elements = elements / 360,
+    while (param) {
+        if (separator == '?' && !memcmp(param, SLEN("from=")))
+            from = (uint32)strtoul(param + strlen("from="), &param, 10);
+        else if (separator == '?' && !memcmp(param, SLEN("to=")))
+            to = (uint32)strtoul(param + strlen("to="), &param, 10);
+        else if (!memcmp(param, SLEN("points=")))
+            points = (uint32)strtoul(param + strlen("points="), &param, 10);
+        else if (!memcmp(param, SLEN("binary")))
+            binary = true, param += strlen("binary");
+        else if (!memcmp(param, SLEN("envelope")))
+            envelope = true, param += strlen("envelope");
+        else
+            return;
+        if (*param == ' ')
+            break;
+        if (*param++ != '&')
+            return;
+    }
+    if (separator == '?') {
+        if (from >= to)
+            return;
+        etag = etag_add(etag_add(etag, from), to);
+        start = from, end = to;
+    }
+    if (!points || points > MAX_POINTS)
+        return;
+    if (envelope && points > 1) // every datapoint becomes two
+        points /= 2;
+    if (points > end - start)
+        points = end - start;
+    if (etag_not_modified(etag_add(etag_add(etag_add(etag, points), binary), envelope), API_CACHE_HEADERS))
+        return;
+    span = (end - start + points - 1) / points; // of a datapoint, in seconds
+    uint32 data_len = data_count(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state), pos = time_index_find(monitor, start), average_over_n_elements = span / CONFIG_MEASURE_EVERY_N_SECONDS,
            count_for_avg = 0,
            count_for_datapoint_avg = 0,
-           remaining_read = elements * sizeof(stats_t);
-    if (go_back_n_elements < total_elements)
-        pos = sizeof(stats_t) * (total_elements - go_back_n_elements);
-    if (pos + remaining_read > file_len)
-        remaining_read = total_elements * sizeof(stats_t) - pos;
+           datapoints_start = 0, // where the first datapoint starts in json_out
+           datapoint_time_max = 0, // of the newest datapoint written
+           envelope_time[2] = { 0, 0 }, // the times of the first and the last element of the datapoint
+           remaining_read = pos < data_len ? data_len - pos : 0, // in stats_t
+           count;
     double max[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 }, // cpu usage, iowait, steal, ram usage, swap usage, disk usage
            sum_for_avg[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 },
-           sum_for_datapoint_avg[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+           sum_for_datapoint_avg[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 },
+           envelope_values[2][6]; // the minima and maxima of the datapoint, see ?envelope
     uint64 max_uint[5] = { 0, 0, 0, 0, 0 }, // rx, tx, disk_read, disk_write, time
            sum_for_avg_uint[4] = { 0, 0, 0, 0 },
            sum_for_datapoint_avg_uint[5] = { 0, 0, 0, 0, 0 },
            total_uint[4] = { 0, 0, 0, 0 },
+           envelope_values_uint[2][4],
            last_time = 0;
     uint16 count_of_datapoints = 0;
     int32 read_len;
+    data_map_t map = { NULL, 0, 0, 0, NULL };
     bool save_because_downtime = false;
-    while (remaining_read && (read_len = pread(monitor->fd, http_buf, min(remaining_read, min(sizeof(stats_t) * (sizeof(http_buf) / sizeof(stats_t)), file_len - pos)), pos)) > 0) {
-        uint16 count = read_len / sizeof(stats_t);
-        pos += count * sizeof(stats_t);
-        remaining_read -= count * sizeof(stats_t);
+    int8 tier = ROLLUP_TIERS - 1;
+    chart_count = 0;
+    for (uint8 i = 0; i < 10; ++i)
+        digests[i].count = 0;
+    if (!average_over_n_elements) // a range shorter than points measurements
+        average_over_n_elements = 1;
+    if (!binary) {
+        json_key("data"); // data is written first, the values before it are moved in front of it afterwards
+        json_open("{");
+        datapoints_start = json_out_len;
+    }
+    while (tier >= 0 && rollup_tier_seconds[tier] > span) // the coarsest tier that still has at least one interval per datapoint
+        --tier;
+    if (tier >= 0) { // the data is read from the rollup files instead of the raw data, see rollups_add()
+        remaining_read = 0;
+        int fd = monitor->rollup_fds[tier];
+        uint32 rollup_count = rollups_count(fd), low = 0, high = rollup_count, point = (uint32)-1, chunk_count = 0, chunk_pos = 0, rollup_time;
+        rollup_t current, *rollups = NULL;
+        memcpy(&current, &monitor->state->rollups[tier], sizeof(rollup_t)); // without locking because this process could be killed while holding the lock, in the worst case the last datapoint is slightly off
+        bool current_used = !current.count; // it is skipped like the others if it is after the end
+        while (low < high) { // binary search for the first interval in the period
+            uint32 mid = low + (high - low) / 2;
+            if (pread(fd, &rollup_time, sizeof(uint32), ROLLUP_OFFSET(mid)) != sizeof(uint32))
+                break;
+            if (rollup_time < start)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        for (;;) {
+            if (chunk_pos == chunk_count) {
+                if (low < rollup_count && (read_len = pread(fd, http_buf, min(rollup_count - low, sizeof(http_buf) / sizeof(rollup_t)) * sizeof(rollup_t), ROLLUP_OFFSET(low))) >= (int32)sizeof(rollup_t)) {
+                    chunk_count = read_len / sizeof(rollup_t);
+                    low += chunk_count;
+                    rollups = (rollup_t *)http_buf;
+                } else if (!current_used) { // the current interval isn't in the file yet
+                    current_used = true;
+                    chunk_count = 1;
+                    rollups = &current;
+                } else
+                    break;
+                chunk_pos = 0;
+            }
+            rollup_t *rollup = rollups + chunk_pos++;
+            if (rollup->time >= end)
+                break;
+            if (rollup->time < start || !rollup->count)
+                continue;
+            if ((rollup->time - start) / span != point) {
+                if (count_for_datapoint_avg) {
+                    ADD_DATAPOINT();
+                    memset(sum_for_datapoint_avg, 0, sizeof(sum_for_datapoint_avg));
+                    memset(sum_for_datapoint_avg_uint, 0, sizeof(sum_for_datapoint_avg_uint));
+                    count_for_datapoint_avg = 0;
+                    if (DATAPOINTS_FULL())
+                        break;
+                }
+                point = (rollup->time - start) / span;
+            }
+            for (uint8 i = 0; i < 6; ++i) {
+                if (rollup->percent_max[i] / 100.0 > max[i])
+                    max[i] = rollup->percent_max[i] / 100.0;
+                sum_for_avg[i] += rollup->percent_sum[i] / 100.0;
+                sum_for_datapoint_avg[i] += rollup->percent_sum[i] / 100.0;
+            }
+            for (uint8 i = 0; i < 4; ++i) {
+                total_uint[i] += rollup->bytes_sum[i];
+                if (rollup->rate_max[i] > max_uint[i])
+                    max_uint[i] = rollup->rate_max[i];
+                sum_for_avg_uint[i] += rollup->rate_sum[i];
+                sum_for_datapoint_avg_uint[i] += rollup->rate_sum[i];
+            }
+            ADD_TO_ENVELOPE(rollup->time, rollup->time_sum / rollup->count, rollup->percent_min[i] / 100.0, rollup->percent_max[i] / 100.0, rollup->rate_min[i], rollup->rate_max[i]);
+            for (uint8 i = 0; i < 10; ++i)
+                for (uint8 y = 0; y < ROLLUP_CENTROIDS && rollup->centroids[i][y].count; ++y)
+                    digest_add(&digests[i], i < 6 ? rollup->centroids[i][y].mean / 100.0 : centroid_rate_decode(rollup->centroids[i][y].mean), rollup->centroids[i][y].count);
+            count_for_avg += rollup->count, count_for_datapoint_avg += rollup->count;
+            sum_for_datapoint_avg_uint[4] += rollup->time_sum;
+        }
+    }
+    while (remaining_read) {
+        count = min(remaining_read, sizeof(http_buf) / sizeof(stats_t));
+        const stats_t *stats = data_map_read(&map, monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state, pos, (stats_t *)http_buf, &count);
+        if (!count)
+            break;
+        pos += count;
+        remaining_read -= count;
         for (uint16 i = 0; i < count; ++i) {
-            stats_t *element = (stats_t *)http_buf + i;
+            const stats_t *element = stats + i;
+            if (element->time >= end) {
+                remaining_read = 0;
+                break;
+            }
             double data[6] = { TO_DOUBLE_FROM_TWO_UINTS(element->cpu_usage), TO_DOUBLE_FROM_TWO_UINTS(element->cpu_iowait), TO_DOUBLE_FROM_TWO_UINTS(element->cpu_steal), TO_DOUBLE_FROM_TWO_UINTS(element->ram_usage), TO_DOUBLE_FROM_TWO_UINTS(element->swap_usage), TO_DOUBLE_FROM_TWO_UINTS(element->disk_usage) };
             uint32 time_diff = last_time ? element->time - last_time : CONFIG_MEASURE_EVERY_N_SECONDS;
             if (time_diff > (32 * (average_over_n_elements + 3))) {
@@ -442,55 +1202,72 @@ void api_data(void) {
                 sum_for_avg_uint[i] += data_uint[i];
                 sum_for_datapoint_avg_uint[i] += data_uint[i];
             }
+            ADD_TO_ENVELOPE(element->time, element->time, data[i], data[i], data_uint[i], data_uint[i]);
+            for (uint8 i = 0; i < 10; ++i)
+                digest_add(&digests[i], i < 6 ? data[i] : data_uint[i - 6], 1);
             ++count_for_avg, ++count_for_datapoint_avg;
             sum_for_datapoint_avg_uint[4] += element->time;
             last_time = element->time;
             if (count_for_datapoint_avg == average_over_n_elements || save_because_downtime) {
-                json_object *data_element;
-                if ((data_element = json_object_new_array())) {
-                    ADD_DATA(data_element, sum_for_datapoint_avg[i] / count_for_datapoint_avg, sum_for_datapoint_avg_uint[i] / count_for_datapoint_avg);
-                    char buf[16];
-                    uint64 time = sum_for_datapoint_avg_uint[4] / count_for_datapoint_avg;
-                    buf[itoa(time, buf)] = '\0';
-                    json_object_object_add(data_json, buf, data_element);
-                }
+                ADD_DATAPOINT();
                 memset(sum_for_datapoint_avg, 0, sizeof(sum_for_datapoint_avg));
                 memset(sum_for_datapoint_avg_uint, 0, sizeof(sum_for_datapoint_avg_uint));
                 count_for_datapoint_avg = 0;
-                if (++count_of_datapoints == 400)
+                if (DATAPOINTS_FULL())
                     break;
             }
         }
     }
-    if (count_for_datapoint_avg) { // if this is the case it didn't break before because the count was 400, so no check necessary
-        json_object *data_element;
-        if ((data_element = json_object_new_array())) {
-            ADD_DATA(data_element, sum_for_datapoint_avg[i] / count_for_datapoint_avg, sum_for_datapoint_avg_uint[i] / count_for_datapoint_avg);
-            char buf[16];
-            uint64 time = sum_for_datapoint_avg_uint[4] / count_for_datapoint_avg;
-            buf[itoa(time, buf)] = '\0';
-            json_object_object_add(data_json, buf, data_element);
-        }
+    data_map_close(&map);
+    if (count_for_datapoint_avg) // if this is the case it didn't break before because there was no space, so no check necessary
+        ADD_DATAPOINT();
+    if (!binary)
+        json_close('}');
+    uint32 data_end = json_out_len;
+    if (binary)
+        json_raw("\0\0\0\0", sizeof(uint32)); // json_len, set below
+    json_open("{");
+    IF_SHOULD_SHOW(SHOULD_HIDE_TOTAL_TRAFFIC) {
+        json_key("traffic");
+        json_open("[");
+        json_uint(total_uint[0]);
+        json_uint(total_uint[1]);
+        json_uint(monitor->state->rx_total);
+        json_uint(monitor->state->tx_total);
+        json_close(']');
+    }
+    IF_SHOULD_SHOW(SHOULD_HIDE_TOTAL_IO) {
+        json_key("io");
+        json_open("[");
+        json_uint(total_uint[2]);
+        json_uint(total_uint[3]);
+        json_uint(monitor->state->sectors_read_total * SECTOR_SIZE);
+        json_uint(monitor->state->sectors_written_total * SECTOR_SIZE);
+        json_close(']');
     }
-    ADD_DATA(max_json, max[i], max_uint[i]);
+    json_key("details");
+    json_monitor_details(monitor, name, now, admin);
+    json_close(']');
+    json_key("max");
+    ADD_DATA(max[i], max_uint[i]);
+    json_key("avg");
     if (count_for_avg) {
-        ADD_DATA(avg_json, sum_for_avg[i] / count_for_avg, sum_for_avg_uint[i] / count_for_avg);
+        ADD_DATA(sum_for_avg[i] / count_for_avg, sum_for_avg_uint[i] / count_for_avg);
     } else {
+        json_open("[");
         for (uint8 i = 0; i < 10; ++i)
-            json_object_array_add(avg_json, json_object_new_uint64(0));
-    }
-    IF_SHOULD_SHOW(SHOULD_HIDE_TOTAL_TRAFFIC) {
-        json_object_array_add(traffic_json, json_object_new_uint64(total_uint[0]));
-        json_object_array_add(traffic_json, json_object_new_uint64(total_uint[1]));
-        json_object_array_add(traffic_json, json_object_new_uint64(monitor->rx_total));
-        json_object_array_add(traffic_json, json_object_new_uint64(monitor->tx_total));
-    }
-    IF_SHOULD_SHOW(SHOULD_HIDE_TOTAL_IO) {
-        json_object_array_add(io_json, json_object_new_uint64(total_uint[2]));
-        json_object_array_add(io_json, json_object_new_uint64(total_uint[3]));
-        json_object_array_add(io_json, json_object_new_uint64(monitor->sectors_read_total * SECTOR_SIZE));
-        json_object_array_add(io_json, json_object_new_uint64(monitor->sectors_written_total * SECTOR_SIZE));
+            json_uint(0);
+        json_close(']');
     }
+    for (uint8 i = 0; i < 10; ++i)
+        digest_compress(&digests[i]);
+    json_key("p50");
+    ADD_DATA(digest_quantile(&digests[i], 0.5), (uint64)(digest_quantile(&digests[6 + i], 0.5) + 0.5));
+    json_key("p95");
+    ADD_DATA(digest_quantile(&digests[i], 0.95), (uint64)(digest_quantile(&digests[6 + i], 0.95) + 0.5));
+    json_key("p99");
+    ADD_DATA(digest_quantile(&digests[i], 0.99), (uint64)(digest_quantile(&digests[6 + i], 0.99) + 0.5));
+    json_move_to_front(data_end);
     uint8 id_to_hidden[] = {
         SHOULD_HIDE_CPU_USAGE,
         SHOULD_HIDE_CPU_IOWAIT,
@@ -503,9 +1280,283 @@ void api_data(void) {
         SHOULD_HIDE_IO,
         SHOULD_HIDE_IO
     };
+    json_key("hidden");
+    json_open("[");
     for (uint8 i = 0; i < sizeof(id_to_hidden); ++i)
-        json_object_array_add(hidden_json, json_object_new_boolean(!SHOULD_SHOW(id_to_hidden[i])));
-    client_write_json(response);
+        json_bool(!SHOULD_SHOW(id_to_hidden[i]));
+    json_close(']');
+    json_key("notes");
+    if (notes)
+        json_value(notes);
+    else
+        json_bool(false);
+    json_close('}');
+    if (binary && !json_failed) {
+        json_out[json_out_len - 1] = ' '; // the comma
+        while ((json_out_len - JSON_HEADER_SPACE) % 4)
+            json_raw(" ", 1);
+        uint32 count = chart_count, json_len = json_out_len - JSON_HEADER_SPACE - sizeof(uint32);
+        memcpy(json_out + JSON_HEADER_SPACE, &json_len, sizeof(uint32));
+        json_raw((char *)&count, sizeof(uint32));
+        json_raw((char *)chart_time, count * sizeof(uint32));
+        for (uint8 i = 0; i < 10; ++i)
+            IF_SHOULD_SHOW(i < 6 ? i_to_id_percent[i] : i_to_id_uint[i - 6])
+                json_raw((char *)chart_values[i], count * sizeof(float));
+    }
+    json_send(binary);
+}
+
+/*
+/api/history/{PERIOD}/{BACK}/{METRICS}/{MONITORS}
+The data of several monitors at once (e.g. to compare them), in the same time buckets for all of them.
+
+{PERIOD} and {BACK} like for /api/data/, but the period ends with the current bucket (and not with the last data received from the monitor).
+{METRICS} is a comma-separated list of DATA_ELEMENT names (see /api/data/), e.g. cpu_usage,ram_usage
+{MONITORS} is either a comma-separated list of public ids or the name of a page (like {PAGE} for /api/page/{PAGE}), at most HISTORY_MAX_MONITORS.
+
+Output json:
+    - time: [uint], the UNIX timestamps of the starts of the 360 buckets
+    - metrics: [string], the names of the metrics that are sent, in the order of DATA_ELEMENT
+    - monitors: array of [public_id: string, name: string, and for each metric either false if it is hidden or the averages in the buckets: [double|uint|null], null if there's no data in the bucket]
+*/
+
+#define HISTORY_BUCKETS 360
+#define HISTORY_MAX_MONITORS 100
+const char *history_metric_names[10] = { "cpu_usage", "cpu_iowait", "cpu_steal", "ram_usage", "swap_usage", "disk_usage", "rx_bytes_per_second", "tx_bytes_per_second", "disk_read_bytes_per_second", "disk_write_bytes_per_second" };
+const uint8 history_metric_hidden[10] = { SHOULD_HIDE_CPU_USAGE, SHOULD_HIDE_CPU_IOWAIT, SHOULD_HIDE_CPU_STEAL, SHOULD_HIDE_RAM_USAGE, SHOULD_HIDE_SWAP_USAGE, SHOULD_HIDE_DISK_USAGE, SHOULD_HIDE_NET, SHOULD_HIDE_NET, SHOULD_HIDE_IO, SHOULD_HIDE_IO };
+double history_sum[6][HISTORY_BUCKETS];
+uint64 history_sum_uint[4][HISTORY_BUCKETS];
+uint32 history_count[HISTORY_BUCKETS];
+
+typedef struct {
+    uint32 elements, back;
+    uint16 metrics; // bit i for history_metric_names[i]
+    uint32 count;
+    monitor_details_t *monitors[HISTORY_MAX_MONITORS];
+    json_object *names[HISTORY_MAX_MONITORS];
+} history_request_t;
+
+bool history_add_monitor(history_request_t *request, const char *public_id) { // public_id has to be terminated
+    json_object *monitor_obj, *name;
+    monitor_details_t *monitor = get_monitor_details_by_public(public_id);
+    if (!monitor || request->count == HISTORY_MAX_MONITORS || !json_object_object_get_ex(monitors, public_id, &monitor_obj) || !json_object_is_type(monitor_obj, json_type_array) || !(name = json_object_array_get_idx(monitor_obj, 1)) || !json_object_is_type(name, json_type_string))
+        return false;
+    request->monitors[request->count] = monitor;
+    request->names[request->count++] = name;
+    return true;
+}
+
+bool history_parse(history_request_t *request, bool admin) { // false if the request is invalid or the page may not be seen. http_buf is left unchanged, as the parent uses this too, see request_use_files()
+    char *path = http_buf + strlen("GET /api/history/"), *path_end = memchr(path, ' ', len - strlen("GET /api/history/")), *part_end, period[4];
+    bool success = false;
+    if ((uint32)len <= strlen("GET /api/history/") || !path_end || !(part_end = memchr(path, '/', path_end - path)) || part_end - path >= (int32)sizeof(period))
+        return false;
+    *path_end = '\0';
+    memcpy(period, path, part_end - path);
+    period[part_end - path] = '\0';
+    request->metrics = 0;
+    request->count = 0;
+    if (!(request->elements = period_to_elements(period)) || !isdigit(part_end[1]) || (request->back = (uint32)strtoul(part_end + 1, &path, 10)) > MAX_BACK || *path++ != '/')
+        goto out;
+    for (;;) { // the metrics
+        uint8 i = 0;
+        while (i < 10 && (memcmp(path, history_metric_names[i], strlen(history_metric_names[i])) || (path[strlen(history_metric_names[i])] != ',' && path[strlen(history_metric_names[i])] != '/')))
+            ++i;
+        if (i == 10)
+            goto out;
+        request->metrics |= 1 << i;
+        path += strlen(history_metric_names[i]);
+        if (*path++ == '/')
+            break;
+    }
+    uint32 list_len = strlen(path);
+    bool ids = list_len % 33 == 32;
+    for (uint32 i = 0; ids && i < list_len; ++i)
+        ids = i % 33 == 32 ? path[i] == ',' : isxdigit(path[i]) != 0;
+    if (ids) {
+        for (uint32 i = 0; i < list_len; i += 33) {
+            char public_id[33];
+            memcpy(public_id, path + i, 32);
+            public_id[32] = '\0';
+            if (!history_add_monitor(request, public_id))
+                goto out;
+        }
+        success = true;
+        goto out;
+    }
+    json_object *page_monitors;
+    uint8 state = get_page(path, NULL, &page_monitors, admin);
+    if (state == PAGE_SUCCESS) {
+        for (uint32 pos = 0, count = json_object_array_length(page_monitors); pos < count; ++pos) {
+            json_object *public_id = json_object_array_get_idx(page_monitors, pos);
+            if (json_object_is_type(public_id, json_type_string) && json_object_get_string_len(public_id) == 32 && !history_add_monitor(request, json_object_get_string(public_id)) && request->count == HISTORY_MAX_MONITORS)
+                goto out;
+        }
+    } else if (state == PAGE_SHOW_ALL) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // allow ({}) in foreach
+        json_object_object_foreach(monitors, public_id_str, val) {
+            (void)val;
+            if (strlen(public_id_str) == 32 && !history_add_monitor(request, public_id_str) && request->count == HISTORY_MAX_MONITORS)
+                goto out;
+        }
+#pragma GCC diagnostic pop
+    } else
+        goto out;
+    success = true;
+out:
+    *path_end = ' ';
+    return success;
+}
+
+void history_scan(monitor_details_t *monitor, int64 start, uint32 span) { // sums up the data of the monitor in the HISTORY_BUCKETS buckets of span seconds from start on, like api_data()
+    int64 end = start + (int64)span * HISTORY_BUCKETS;
+    int8 tier = ROLLUP_TIERS - 1;
+    int32 read_len;
+    memset(history_sum, 0, sizeof(history_sum));
+    memset(history_sum_uint, 0, sizeof(history_sum_uint));
+    memset(history_count, 0, sizeof(history_count));
+    while (tier >= 0 && rollup_tier_seconds[tier] > span) // the coarsest tier whose intervals aren't longer than a bucket
+        --tier;
+    if (tier >= 0) {
+        int fd = monitor->rollup_fds[tier];
+        uint32 rollup_count = rollups_count(fd), low = 0, high = rollup_count, rollup_time, last_time = 0;
+        rollup_t current;
+        memcpy(&current, &monitor->state->rollups[tier], sizeof(rollup_t)); // without locking, see api_data()
+        while (low < high) { // binary search for the first interval in the period
+            uint32 mid = low + (high - low) / 2;
+            if (pread(fd, &rollup_time, sizeof(uint32), ROLLUP_OFFSET(mid)) != sizeof(uint32))
+                break;
+            if (rollup_time < start)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        for (bool done = false; !done;) {
+            uint32 chunk_count;
+            rollup_t *rollups = (rollup_t *)http_buf;
+            if (low < rollup_count && (read_len = pread(fd, http_buf, min(rollup_count - low, sizeof(http_buf) / sizeof(rollup_t)) * sizeof(rollup_t), ROLLUP_OFFSET(low))) >= (int32)sizeof(rollup_t)) {
+                chunk_count = read_len / sizeof(rollup_t);
+                low += chunk_count;
+            } else { // the current interval isn't in the file yet
+                done = true;
+                chunk_count = current.count && current.time > last_time;
+                rollups = &current;
+            }
+            for (uint32 i = 0; i < chunk_count; ++i) {
+                rollup_t *rollup = rollups + i;
+                if (rollup->time >= end) {
+                    done = true;
+                    break;
+                }
+                last_time = rollup->time;
+                if (rollup->time < start || !rollup->count)
+                    continue;
+                uint32 bucket = (rollup->time - start) / span;
+                for (uint8 y = 0; y < 6; ++y)
+                    history_sum[y][bucket] += rollup->percent_sum[y] / 100.0;
+                for (uint8 y = 0; y < 4; ++y)
+                    history_sum_uint[y][bucket] += rollup->rate_sum[y];
+                history_count[bucket] += rollup->count;
+            }
+        }
+        return;
+    }
+    uint32 data_len = data_count(monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state), pos = time_index_find(monitor, start), remaining_read = pos < data_len ? data_len - pos : 0, last_time = 0, count;
+    data_map_t map = { NULL, 0, 0, 0, NULL };
+    while (remaining_read) {
+        count = min(remaining_read, sizeof(http_buf) / sizeof(stats_t));
+        const stats_t *stats = data_map_read(&map, monitor->fd, monitor->segments_fd, monitor->segment_offsets_fd, monitor->state, pos, (stats_t *)http_buf, &count);
+        if (!count)
+            break;
+        pos += count;
+        remaining_read -= count;
+        for (uint16 i = 0; i < count; ++i) {
+            const stats_t *element = stats + i;
+            if (element->time >= end) {
+                remaining_read = 0;
+                break;
+            }
+            uint32 time_diff = last_time ? element->time - last_time : CONFIG_MEASURE_EVERY_N_SECONDS;
+            if (!time_diff || time_diff > 32 * (span / 60 + 3))
+                time_diff = CONFIG_MEASURE_EVERY_N_SECONDS;
+            last_time = element->time;
+            if (element->time < start)
+                continue;
+            uint32 bucket = (element->time - start) / span;
+            history_sum[0][bucket] += TO_DOUBLE_FROM_TWO_UINTS(element->cpu_usage);
+            history_sum[1][bucket] += TO_DOUBLE_FROM_TWO_UINTS(element->cpu_iowait);
+            history_sum[2][bucket] += TO_DOUBLE_FROM_TWO_UINTS(element->cpu_steal);
+            history_sum[3][bucket] += TO_DOUBLE_FROM_TWO_UINTS(element->ram_usage);
+            history_sum[4][bucket] += TO_DOUBLE_FROM_TWO_UINTS(element->swap_usage);
+            history_sum[5][bucket] += TO_DOUBLE_FROM_TWO_UINTS(element->disk_usage);
+            history_sum_uint[0][bucket] += element->rx_bytes / time_diff;
+            history_sum_uint[1][bucket] += element->tx_bytes / time_diff;
+            history_sum_uint[2][bucket] += SECTOR_SIZE * (element->read_sectors / time_diff);
+            history_sum_uint[3][bucket] += SECTOR_SIZE * (element->written_sectors / time_diff);
+            ++history_count[bucket];
+        }
+    }
+    data_map_close(&map);
+}
+
+void api_history(void) {
+    history_request_t request;
+    bool admin = is_logged_in();
+    if (!history_parse(&request, admin))
+        return;
+    uint32 now = time(NULL), span = request.elements * 60 / HISTORY_BUCKETS; // elements are minutes
+    int64 end = ((int64)now / span + 1) * span - (int64)request.back * span * HISTORY_BUCKETS, start = end - (int64)span * HISTORY_BUCKETS;
+    if (start < 0)
+        return;
+    uint64 etag = etag_add(etag_add(etag_api(admin), end), request.metrics);
+    for (uint32 i = 0; i < request.count; ++i)
+        etag = etag_add(etag, __atomic_load_n(&request.monitors[i]->state->version, __ATOMIC_ACQUIRE)); // unlike for /api/data/, whether the monitor is online doesn't matter
+    if (etag_not_modified(etag, API_CACHE_HEADERS))
+        return;
+    json_open("{");
+    json_key("time");
+    json_open("[");
+    for (uint32 i = 0; i < HISTORY_BUCKETS; ++i)
+        json_uint(start + (int64)i * span);
+    json_close(']');
+    json_key("metrics");
+    json_open("[");
+    for (uint8 i = 0; i < 10; ++i)
+        if (request.metrics & (1 << i))
+            json_string(history_metric_names[i], strlen(history_metric_names[i]));
+    json_close(']');
+    json_key("monitors");
+    json_open("[");
+    for (uint32 pos = 0; pos < request.count && !json_failed; ++pos) {
+        monitor_details_t *monitor = request.monitors[pos];
+        history_scan(monitor, start, span);
+        json_open("[");
+        json_string(monitor->public_token, 32);
+        json_value(request.names[pos]);
+        for (uint8 i = 0; i < 10; ++i) {
+            if (!(request.metrics & (1 << i)))
+                continue;
+            if (!SHOULD_SHOW(history_metric_hidden[i])) {
+                json_bool(false);
+                continue;
+            }
+            json_open("[");
+            for (uint32 bucket = 0; bucket < HISTORY_BUCKETS; ++bucket) {
+                if (!history_count[bucket])
+                    json_raw(SLEN("null,"));
+                else if (i < 6)
+                    json_double(history_sum[i][bucket] / history_count[bucket]);
+                else
+                    json_uint(history_sum_uint[i - 6][bucket] / history_count[bucket]);
+            }
+            json_close(']');
+        }
+        json_close(']');
+    }
+    json_close(']');
+    json_close('}');
+    json_send(false);
 }
 
 void api(void) {
@@ -513,11 +1564,14 @@ void api(void) {
         api_page();
     else if (http_buf_compare("GET /api/", "data/"))
         api_data();
+    else if (http_buf_compare("GET /api/", "history/"))
+        api_history();
 }
 
 void process_request(void) {
     if ((uint32)len < strlen("GET / HTTP/1.1\r\n\r\n"))
         return;
+    accepted_encodings = get_accepted_encodings();
     if (http_buf_compare("GET /", "api/")) {
         api();
         return;
@@ -530,19 +1584,19 @@ void process_request(void) {
             if (!isxdigit(public_id[i]))
                 goto not_found;
         if (get_monitor_details_by_public(public_id)) {
-            client_http_sendfile(monitor_page_fd);
+            client_http_sendfile(monitor_page_fd, monitor_page_gz_fd, monitor_page_br_fd);
             return;
         }
         goto not_found;
     }
     if (http_buf_compare("GET /", "admin")) {
-        client_http_sendfile(admin_page_fd);
+        client_http_sendfile(admin_page_fd, admin_page_gz_fd, admin_page_br_fd);
         return;
     }
     if (http_buf_compare("GET /", "favicon.ico")) {
         if (favicon_ico_fd == -1)
             goto not_found;
-        client_http_sendfile(favicon_ico_fd);
+        client_http_sendfile(favicon_ico_fd, -1, -1);
         return;
     }
     uint8 state = get_page_from_buf(strlen("GET /"), NULL, NULL, is_logged_in());
@@ -552,7 +1606,7 @@ void process_request(void) {
         client_write("HTTP/1.1 302\r\nLocation: /admin\r\n\r\n");
         return;
     }
-    client_http_sendfile(status_page_fd);
+    client_http_sendfile(status_page_fd, status_page_gz_fd, status_page_br_fd);
     return;
 not_found:
     client_write("HTTP/1.1 404\r\nContent-Type: text/html\r\n\r\n<!DOCTYPE html><html><head><title>404 Not Found</title></head><body><center><h1>404 Not Found</h1></center></body></html>");